@@ -1,16 +1,40 @@
 #include "client_header.h"
 
-unsigned long next_seq_num;
-unsigned long expected_seq_num;
-
-//Initalize the send queue and the receive queue.
-TAILQ_HEAD(sq_head, sq_entry) shead = TAILQ_HEAD_INITIALIZER(shead);
-TAILQ_HEAD(rq_head, rq_entry) rhead = TAILQ_HEAD_INITIALIZER(rhead);
-struct sq_head *sheadp;
-struct rq_head *rheadp;
+// The connection to the other client, through the relay. The protocol engine (proto.c) keeps all its state here.
+struct conn conn;
+int window = DEFAULT_WINDOW;		// Maximum number of packets waiting for an ack (-w).
+int cc_algo = CC_RENO;			// Congestion control (-C).
+int use_binary;				// Send binary headers once the other client says it can parse them (-B).
+
+// Input read from stdin that has not been sent yet, because the window is full or the line is incomplete.
+char in_buf[INBUF_SIZE];
+int in_len;
+int stdin_open = 1;			// More input may come (from stdin, the --send-file file or --generate).
+int input_fd;				// Where input is read from: stdin, or the --send-file file.
+int input_pollable = 1;			// Input is stdin, and epoll can watch it (it can't watch a regular file).
+int input_watched;			// Standard input is in the epoll set.
+
+int epfd;				// epoll instance watching the socket, standard input and the timer.
+int timer_fd;				// timerfd that goes off at the next retransmission or delayed ack.
+long long timer_armed;			// The deadline timer_fd is set to, 0 if it is stopped.
+
+// Benchmark modes. The sender (--send-file or --generate) ends with a BENCH_END line giving what it sent, which the --sink checks.
+int bench_send;
+int bench_sink;
+unsigned long gen_lines;		// Lines --generate still has to make.
+unsigned long gen_next;			// Number of the next generated line.
+int gen_size = GEN_LINE_SIZE;
+int bench_end_sent;
+int bench_status = 1;			// Exit status of the sink: 0 once the BENCH_END line matched what it received.
+long long bench_start;			// When the first packet was sent, or (sink) received.
+unsigned long bench_lines;		// Lines sent, or received in order.
+unsigned long bench_bytes;
+unsigned int bench_crc;			// CRC32C of all of them, in order.
 
 void connect_server(int *sockfd, struct sockaddr_in *server_addr, char *server, int port)
 {
+	int one = 1;
+
 	if ((*sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		fprintf(stderr, "%s:in %s socket error %d",__FILE__,__func__,__LINE__);
 		perror("Socket");
@@ -28,297 +52,425 @@ void connect_server(int *sockfd, struct sockaddr_in *server_addr, char *server,
 		perror("connect");
 		exit(1);
 	}
-	//Initalize the send queue and the receive queue.
-	TAILQ_INIT(&shead);
-	TAILQ_INIT(&rhead);
+	// Packets are sent whole and acks are delayed by the protocol itself, so don't let TCP hold small packets back as well (Nagle's algorithm).
+	if (setsockopt(*sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1) {
+		perror("setsockopt");
+	}
+	//Set up the protocol state for the connection.
+	conn_init(&conn, *sockfd, window, cc_algo, use_binary);
+	conn.deliver = deliver;
 }	
 
-void check_retrans_timeout()
+// Set the timerfd to go off at the next deadline, or stop it if there is none. It takes the time on the same clock as now_us(), so it is set only when the deadline changes, not every time round the loop.
+void arm_timer()
 {
-	struct sq_entry *sn1, *sn2;
+	struct itimerspec its;
+	long long deadline;
 
-	sn1 = TAILQ_FIRST(&shead);
-	//Wait for 5 seconds before sending a retransmission.
-	while (sn1 != NULL) {
-		sn2 = TAILQ_NEXT(sn1, entries);
-		if (time(NULL) > (sn1->tsec + 5)) {
-			if (sn1->num_retrans >= 25) {
-				//Connection timed out. Close the connection
-				fprintf(stderr, "Closing connection due to too many timeouts.\n");
-				close(sn1->sockfd);
-			} else {
-				//send_retransmission
-				fprintf(stderr, "Sending retransmission for seq_num. %d\n", sn1->seq_num);
-				send(sn1->sockfd, sn1->rp, strlen(sn1->rp), MSG_DONTWAIT);
-				sn1->num_retrans++;
-				sn1->tsec = time(NULL);
-				usleep(100 * 1000);
-			}
-		}
-		sn1 = sn2;
+	deadline = next_deadline(&conn);
+	if (deadline == timer_armed) {
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = deadline % 1000000 * 1000;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		exit(-1);
 	}
+	timer_armed = deadline;
 }
 
-struct sq_entry *add_to_send_queue(int sockfd, char *payload, int pl_size)
+// Watch standard input in the epoll set only while there is room in the window for what it brings; until then it waits in the pipe.
+// It is taken out of the set rather than left in with no events, as a closed pipe would still report EPOLLHUP.
+void watch_input(int on)
 {
+	struct epoll_event ev;
 
-	struct sq_entry *entry;
-	int num_char;
-
-	//Add the packet to send queue. This will be useful in sending retranmission.
-	entry = malloc(sizeof(struct sq_entry));
-	if (!entry) {
-		return NULL;
+	if (on == input_watched) {
+		return;
 	}
-
-	memset(entry, 0, sizeof(struct sq_entry));
-	//Add sequence number and ack to the packet. Since we have data in this packet, pure ack is set to 0.
-	num_char = sprintf(entry->rp, "%lu,%lu,%d:", next_seq_num, expected_seq_num, 0);
-	memcpy(entry->rp + num_char, payload, pl_size);
-	entry->seq_num = next_seq_num;
-	entry->tsec = time(NULL);
-	entry->sockfd = sockfd;
-	
-	TAILQ_INSERT_TAIL(&shead, entry, entries);
-	
-	//Increase the sequence number for the next packet.
-	next_seq_num++;
-
-	return entry;
+	ev.events = EPOLLIN;
+	ev.data.fd = 0;
+	if (epoll_ctl(epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, 0, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(-1);
+	}
+	input_watched = on;
 }
 
-int process_recv_packet(int sockfd, char *packet, int pkt_size)
+// Send as many of the buffered input lines as the window allows.
+void send_pending_input()
 {
-	char *seq_num;
-	char *ack_num;
-	char *header;
-	char *data;
-	char *pure_ack;
-	struct rq_entry *entry;
-	char rp[129+MAXWORD+MAXBUFFER+MAXTIME];
-	struct sq_entry *sn1, *sn2;
-	struct rq_entry *rn1, *rn2;
+	char buffer[MAXBUFFER];
+	char *nl;
+	int len, used = 0;
+	struct sq_entry *sentry;
 
-	// Split the header from the actual packet data.
-	header = strtok(packet, ":");
-	if (header == NULL) {
-		return 0;
-	}
-	data = packet + strlen(header) + 1;
+	while (send_room(&conn) > 0 && used < in_len) {
+		nl = memchr(in_buf + used, '\n', in_len - used);
+		if (nl) {
+			len = nl - (in_buf + used) + 1;
+		} else if (in_len - used >= MAXBUFFER - 1 || !stdin_open) {
+			// Like fgets, split lines that don't fit in a packet, and send a last line without a newline as it is.
+			len = in_len - used;
+		} else {
+			// Wait for the rest of the line.
+			break;
+		}
+		if (len > MAXBUFFER - 1) {
+			len = MAXBUFFER - 1;
+		}
+		memcpy(buffer, in_buf + used, len);
+		buffer[len] = '\0';
+		used += len;
+		if (!bench_send && strcmp(buffer, "quit\n") == 0) {
+			fprintf(stderr, "Exiting program.\n");
+			exit(0);
+		}
 
-	// Extract the sequence number from the header.
-	seq_num = strtok(header, ",");
-	if (seq_num == NULL) {
-		// Probably the header is corrupted, drop the packet.
-		return 0;
+		sentry = conn_send(&conn, buffer, len);
+		if (!sentry) {
+			fprintf(stderr, "Out of memory for the send queue.\n");
+			exit(1);
+		}
+		if (bench_send) {
+			if (bench_start == 0) {
+				bench_start = sentry->sent_us;
+			}
+			bench_lines++;
+			bench_bytes += len;
+			bench_crc = crc32c(bench_crc, buffer, len);
+		}
 	}
-
-	// Extract the ack number from the header.
-	ack_num = strtok(NULL, ",");
-
-	if (ack_num == NULL) {
-		// Probably the header is corrupted, drop the packet.
-		return 0;
+	memmove(in_buf, in_buf + used, in_len - used);
+	in_len -= used;
+	if (bench_send && !stdin_open && in_len == 0 && !bench_end_sent && send_room(&conn) > 0) {
+		// All the input is sent. Tell the sink what it should have got.
+		len = sprintf(buffer, "%c %lu %lu %08x\n", BENCH_END, bench_lines, bench_bytes, bench_crc);
+		if (!conn_send(&conn, buffer, len)) {
+			fprintf(stderr, "Out of memory for the send queue.\n");
+			exit(1);
+		}
+		bench_end_sent = 1;
 	}
+}
 
-	// Check if it is a pure ack. Packets with pure ack don't contain any data.
-	pure_ack = ack_num + strlen(ack_num) + 1;
-
-	//Check if we received a packet out of order. If the sequence number on the packet is greater than the expected sequenece number then we have received it out of order.
-	if (atoi(seq_num) > expected_seq_num) {
-		//If the packet is out of order then add it to the receiver buffer queue. The receive buffer queue must be sorted by the sequence number
-		entry = malloc(sizeof(struct rq_entry));
-		if (!entry) {
-			return 1;
+// Make up lines for --generate: each starts with its number and goes on with letters that depend on it, so every run sends the same data.
+void generate_input()
+{
+	unsigned long long x;
+	int i;
+
+	while (gen_next < gen_lines && in_len + gen_size <= INBUF_SIZE) {
+		i = sprintf(in_buf + in_len, "%010lu ", gen_next);
+		x = gen_next * 0x9e3779b97f4a7c15ULL + 1;
+		for (; i < gen_size - 1; i++) {
+			// xorshift64
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			in_buf[in_len + i] = 'a' + x % 26;
 		}
-		memset(entry, 0, sizeof(struct rq_entry));
-		// Copy the packet data only.
-		memcpy(entry->rp, data, pkt_size - strlen(header) - 1);
+		in_buf[in_len + i] = '\n';
+		in_len += gen_size;
+		gen_next++;
+	}
+	if (gen_next == gen_lines) {
+		stdin_open = 0;
+	}
+}
 
-		rn1 = TAILQ_FIRST(&rhead);
-		rn2 = TAILQ_LAST(&rhead, rq_head);
-		if (rn2 && atoi(seq_num) > rn2->seq_num) {
-			// Add to the end of the list as the sequence number on the packet is greater than sequence number of the last packet in the receive queue..
-			entry->seq_num = atoi(seq_num);
-			TAILQ_INSERT_AFTER(&rhead, rn2, entry, entries);
-			fprintf(stderr,"Adding seqnum %d after %d\n", atoi(seq_num), rn2->seq_num);
-		} else if (rn1) {
-			//Add the packet before the packet with sequence number greater than this packet's sequence number.
-			while (rn1 != NULL) {
-				rn2 = TAILQ_NEXT(rn1, entries);
-				if (rn1->seq_num == atoi(seq_num)) {
-					//If this sequeunce number is already present then we have possibly received a duplicate packet. Just ignore it.
-					fprintf(stderr, "Sequence number %d already present. Possible duplicate.\n", rn1->seq_num);	
-					break;
-				} else if (rn1->seq_num > atoi(seq_num)) {
-					//Add the packet before the packet with sequence number greater than this packet's sequence number.
-					fprintf(stderr,"Adding seqnum %d before %d\n", atoi(seq_num), rn1->seq_num);
-					entry->seq_num = atoi(seq_num);
-					TAILQ_INSERT_BEFORE(rn1, entry, entries);
-					break;
-				}
-				rn1 = rn2;
-			}
-		} else {
-			//We reached here because there is no element in the receive queue.
-			fprintf(stderr,"Adding seqnum %d at start\n", atoi(seq_num));
-			entry->seq_num = atoi(seq_num);
-			TAILQ_INSERT_HEAD(&rhead, entry, entries);
-		}
+// Hand data received in order to the user, or with --sink check it and count it instead.
+void deliver(struct conn *c, char *data, int len)
+{
+	unsigned long lines, bytes;
+	unsigned int crc;
+	double secs;
 
-		fprintf(stderr,"Expected seq num was: %lu\n", expected_seq_num);
-	} else  {
-		//Recieved a packet in correct order.
-		//If this is not a pure ack then we need to send the data to the user.
-		if (atoi(pure_ack) == 0) {
-			if (atoi(seq_num) == expected_seq_num) {
-				printf("%s" , data);
-				fflush(stdout);
-				//Increase the next expected sequence number.
-				expected_seq_num++;
-			}
+	if (!bench_sink) {
+		fwrite(data, 1, len, stdout);
+		return;
+	}
+	if (bench_start == 0) {
+		bench_start = now_us();
+	}
+	if (data[0] != BENCH_END) {
+		bench_lines++;
+		bench_bytes += len;
+		bench_crc = crc32c(bench_crc, data, len);
+		return;
+	}
+	// The end of the benchmark. The sender exits once this is acked, and so do we when it disconnects.
+	secs = (now_us() - bench_start) / 1e6;
+	if (sscanf(data + 1, "%lu %lu %x", &lines, &bytes, &crc) == 3 && lines == bench_lines && bytes == bench_bytes && crc == bench_crc) {
+		bench_status = 0;
+	}
+	printf("Received %lu lines, %lu bytes in %.3f s: %.1f KB/s goodput, %lu duplicate packets, CRC32C %08x: %s\n",
+	       bench_lines, bench_bytes, secs, bench_bytes / 1024.0 / (secs > 0 ? secs : 1e-6), c->dup_count, bench_crc,
+	       bench_status == 0 ? "matches the sender" : "DOES NOT match the sender");
+	fflush(stdout);
+}
 
-			fprintf(stderr, "Seq num %d processed.\n", atoi(seq_num));
-			fprintf(stderr, "Ack num %d processed.\n", atoi(ack_num));
-			//Send pure ack, don't increase sequence number.
-			memset(rp, 0, sizeof(rp));
-			sprintf(rp, "%lu,%d,%d:\n%c", next_seq_num, atoi(seq_num)+1, 1,'\0');
-			fprintf(stderr, "Sending pure ack %s\n",rp);
-			//Send a pure ack for this packet 
-			send(sockfd, rp, strlen(rp), MSG_DONTWAIT);
+// Print what the sender's benchmark sent: all of it, or (done is 0) what it got to before the connection was lost.
+void bench_report(int done)
+{
+	double secs;
+
+	secs = bench_start ? (now_us() - bench_start) / 1e6 : 0;
+	if (!done) {
+		printf("Connection lost after %.3f s: sent %lu lines, %lu bytes, %lu packets (%lu acked), %lu retransmissions, CRC32C %08x so far\n",
+		       secs, bench_lines, bench_bytes, conn.next_seq_num, conn.snd_una, conn.retrans_count, bench_crc);
+		fflush(stdout);
+		return;
+	}
+	printf("Sent %lu lines, %lu bytes in %.3f s: %.1f KB/s goodput, %lu packets, %lu retransmissions (%.2f%%), CRC32C %08x\n",
+	       bench_lines, bench_bytes, secs, bench_bytes / 1024.0 / (secs > 0 ? secs : 1e-6),
+	       conn.next_seq_num, conn.retrans_count, 100.0 * conn.retrans_count / conn.next_seq_num, bench_crc);
+}
 
-			rn1 = TAILQ_FIRST(&rhead);
-			// Check if we need to process any packets that are already present in the receiver buffer queue.
-			while (rn1 != NULL) {
-				rn2 = TAILQ_NEXT(rn1, entries);
-				if (rn1->seq_num == expected_seq_num) {
-					printf("%s",rn1->rp);
-					fflush(stdout);
-					fprintf(stderr, "Seq num %d processed.\n", rn1->seq_num);
-					TAILQ_REMOVE(&rhead, rn1, entries);
-					//Send ack for buffered packet.
-					memset(rp, 0, sizeof(rp));
-					sprintf(rp, "%lu,%d,%d:\n%c", next_seq_num, rn1->seq_num+1, 1, '\0');
-					fprintf(stderr, "Sending Pure ack %s\n",rp);
-					//Send a pure ack for this packet and remove it from the receive buffer queue.
-					send(sockfd, rp, strlen(rp), MSG_DONTWAIT);
-					free(rn1);
-					expected_seq_num++;
-				}
-				rn1 = rn2;
-			}
+// The sender's benchmark is over once everything, the BENCH_END line included, has been acked.
+void bench_check_done()
+{
+	if (!bench_send || !bench_end_sent || conn.snd_una != conn.next_seq_num) {
+		return;
+	}
+	bench_report(1);
+	exit(0);
+}
 
-			fprintf(stderr, "Next expected seq num: %lu\n", expected_seq_num);
-		} else {
-			fprintf(stderr, "Pure ack is received: %d\n", atoi(pure_ack));
-			//Remove this packet from the send queue since ack have been received.
-			fprintf(stderr, "data %s\n", data);
+// The connection is gone. A sender whose benchmark isn't over says how far it got, and fails, so a script can tell that from success.
+void bench_lost()
+{
+	if (!bench_send) {
+		return;
+	}
+	bench_check_done();
+	bench_report(0);
+	exit(1);
+}
 
-			sn1 = TAILQ_FIRST(&shead);
-			//Remove all the packets which have sequence number lower than the ack.
-			while (sn1 != NULL) {
-				sn2 = TAILQ_NEXT(sn1, entries);
-				//if (sn1->seq_num <= atoi(ack_num)) {
-				if (sn1->seq_num < atoi(ack_num)) {
-					//fprintf(stderr, "Ack num %d removed.\n", atoi(ack_num));
-					fprintf(stderr, "Ack num %d removed.\n", sn1->seq_num);
-					TAILQ_REMOVE(&shead, sn1, entries);
-					free(sn1);
-				}
-				sn1 = sn2;
-			}
+// Read whatever the user has typed (or piped in) and send what fits in the window.
+void read_input()
+{
+	int n;
+
+	if (gen_lines > 0) {
+		generate_input();
+		send_pending_input();
+		return;
+	}
+	n = read(input_fd, in_buf + in_len, sizeof(in_buf) - in_len);
+	if (n < 0) {
+		if (errno == EINTR) {
+			return;
 		}
+		perror("read");
+		exit(1);
 	}
-	return 0;
+	if (n == 0) {
+		// End of input. Keep running to receive from the other client and to get our packets acked.
+		stdin_open = 0;
+	}
+	in_len += n;
+	send_pending_input();
 }
 
 void chat(int count, int sockfd,char *user_name)
 {
-	//char send_buf[MAXBUFFER];
-	char recv_buf[MAXBUFFER];
-	char buffer[MAXWORD+MAXBUFFER+MAXTIME];
-	//char *user = user_name;
 	int num_byte_recvd;
-	struct sq_entry *sentry;
 
 	if (count == 0) {
-		memset(buffer, 0, sizeof(buffer));
-		// Get message typed by the user.
-		fgets(buffer, MAXBUFFER, stdin);
-		if (strcmp(buffer, "quit\n") == 0) {
-			fprintf(stderr, "Exiting program.\n");
-			exit(0);
-		}
-
-		if (strlen(buffer) == 0) {
-			return;
-		}
-
-		// Add this packet to the send buffer queue before sending it on network.
-		sentry = add_to_send_queue(sockfd, buffer, strlen(buffer));
-		// Send the packet on network.
-		send(sockfd, (char *)(&(sentry->rp)), strlen(sentry->rp), MSG_DONTWAIT);
-		usleep(100 * 1000);
+		// Get messages typed by the user.
+		read_input();
 	} else {
-		//Receive the data.
-		num_byte_recvd = recv(sockfd, recv_buf, MAXBUFFER, 0);
-		recv_buf[num_byte_recvd] = '\0';
-		usleep(100 * 1000);
-		// Analyze and Process the data received.
-		process_recv_packet(sockfd, recv_buf, num_byte_recvd);
+		// Receive the data and process the packets in it.
+		num_byte_recvd = conn_recv(&conn);
+		if (num_byte_recvd <= 0) {
+			if (num_byte_recvd < 0 && errno == EINTR) {
+				return;
+			}
+			fprintf(stderr, "client got disconnected\n");
+			bench_lost();
+			exit(bench_sink ? bench_status : 0);
+		}
+		fflush(stdout);
+		// Acks may have opened the window for more input.
+		send_pending_input();
+		// Ack the packets received, unless that data took the ack along.
+		flush_ack(&conn);
 	}
 }
 
 int main(int argc, char *argv[])
 {
-	int sd, max_sd, count;
+	int sd, i, nev;
 	struct sockaddr_in server_addr;
-	fd_set server,read_sd;
+	struct epoll_event ev, events[MAXEVENTS];
 	char user_name[MAXWORD];
-	struct timeval tv;
-	int sel_ret = 0;
-
-	if (argc < 3) {
-		fprintf(stderr, "Usage: ./client <server_ip> <port_no>\n");
+	unsigned long long expirations;
+	int c;
+	static struct option long_opts[] = {
+		{"send-file", required_argument, 0, 'f'},
+		{"generate", required_argument, 0, 'g'},
+		{"size", required_argument, 0, 's'},
+		{"sink", no_argument, 0, 'k'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "w:BC:h", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'w':
+			// Number of packets that can be sent before waiting for acks.
+			window = atoi(optarg);
+			if (window < 1) {
+				fprintf(stderr, "Window size must be at least 1.\n");
+				exit(-1);
+			}
+			break;
+		case 'B':
+			// Use binary headers with a checksum, if the other client can parse them too.
+			use_binary = 1;
+			break;
+		case 'C':
+			// Congestion control: reno (the default), cubic or none.
+			if (strcmp(optarg, "reno") == 0) {
+				cc_algo = CC_RENO;
+			} else if (strcmp(optarg, "cubic") == 0) {
+				cc_algo = CC_CUBIC;
+			} else if (strcmp(optarg, "none") == 0) {
+				cc_algo = CC_NONE;
+			} else {
+				fprintf(stderr, "Congestion control must be reno, cubic or none.\n");
+				exit(-1);
+			}
+			break;
+		case 'f':
+			// Send the file as fast as the window allows, then say what was sent for a --sink to check.
+			input_fd = open(optarg, O_RDONLY);
+			if (input_fd < 0) {
+				perror(optarg);
+				exit(-1);
+			}
+			bench_send = 1;
+			break;
+		case 'g':
+			// The same with n generated lines instead of a file.
+			gen_lines = strtoul(optarg, NULL, 10);
+			if (gen_lines < 1) {
+				fprintf(stderr, "Number of lines to generate must be at least 1.\n");
+				exit(-1);
+			}
+			bench_send = 1;
+			break;
+		case 's':
+			gen_size = atoi(optarg);
+			if (gen_size < 12 || gen_size > MAXBUFFER - 1) {
+				fprintf(stderr, "Generated lines must be %d to %d bytes.\n", 12, MAXBUFFER - 1);
+				exit(-1);
+			}
+			break;
+		case 'k':
+			// Check and count what the other client sends instead of printing it. Nothing is sent.
+			bench_sink = 1;
+			stdin_open = 0;
+			break;
+		default:
+			fprintf(stderr, "Usage: ./client [-w window] [-B] [-C reno|cubic|none] [--send-file path | --generate n [--size bytes] | --sink] <server_ip> <port_no>\n");
+			exit(-1);
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "Usage: ./client [-w window] [-B] [-C reno|cubic|none] [--send-file path | --generate n [--size bytes] | --sink] <server_ip> <port_no>\n");
+		exit(-1);
+	}
+	if (bench_send && bench_sink) {
+		fprintf(stderr, "A client can't be both the sender and the sink of a benchmark.\n");
 		exit(-1);
 	}
 	// Connect to the server.
-	connect_server(&sd, &server_addr, argv[1], atoi(argv[2]));
+	connect_server(&sd, &server_addr, argv[optind], atoi(argv[optind+1]));
 	fprintf(stderr, "Connected to server.\n");
+	if (use_binary) {
+		fprintf(stderr, "Binary headers, CRC32C using %s.\n", crc32c_impl);
+		// Tell the other client we can parse binary headers. All our acks say so as well, in case this one is lost.
+		send_ack(&conn, conn.expected_seq_num);
+	}
 	fflush(stdin);
-	//Initialize the descriptors for select.
-	FD_ZERO(&server);
-	FD_ZERO(&read_sd);
-	FD_SET(0, &server);
-	FD_SET(sd, &server);
-	max_sd = sd;
-
+	//Watch the socket and the timer, and standard input while there is room in the window.
+	epfd = epoll_create1(0);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epfd == -1 || timer_fd == -1) {
+		perror("epoll_create1/timerfd_create");
+		exit(-1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = sd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(-1);
+	}
+	ev.data.fd = timer_fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(-1);
+	}
+	if (bench_send) {
+		input_pollable = 0;
+	} else if (stdin_open) {
+		ev.data.fd = 0;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, 0, &ev) == 0) {
+			input_watched = 1;
+		} else if (errno == EPERM) {
+			// Standard input is a regular file (or /dev/null), which is always ready.
+			input_pollable = 0;
+		} else {
+			perror("epoll_ctl");
+			exit(-1);
+		}
+	}
 
 	while (1) {
-		read_sd = server;
-		// Timeout value for select system call. Select will wait for this much time and if no data is received on any descriptor select will return with value 0.
-		tv.tv_sec = 0;
-		tv.tv_usec = SELECT_TIMEOUT;
-		/* Wait for data on any socket descriptors or standard input.*/
-		sel_ret = select(max_sd+1, &read_sd, NULL, NULL, &tv);
-		if (sel_ret == -1) {
-			fprintf(stderr,"%s select error %d",__FILE__,__LINE__);
-			perror("select");
-			exit(-1);
+		if (!input_pollable) {
+			// A file or the generator always has more to send, so fill the window before waiting for acks.
+			while (stdin_open && send_room(&conn) > 0) {
+				read_input();
+			}
+			bench_check_done();
+		} else {
+			watch_input(stdin_open && send_room(&conn) > 0);
 		}
-		
-		/* Check if we need to retransmit some packets */
-		check_retrans_timeout();	
-		if (sel_ret == 0) {
-			continue;
+		// Sleep until there is data on the socket or standard input, or the next retransmission or delayed ack is due.
+		arm_timer();
+		nev = epoll_wait(epfd, events, MAXEVENTS, -1);
+		if (nev == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr,"%s epoll_wait error %d",__FILE__,__LINE__);
+			perror("epoll_wait");
+			exit(-1);
 		}
 
-		for (count = 0; count <= max_sd; count++ ) {
-			//Process only if something happened on this descriptor. read_sd was set by select system call.
-			if(FD_ISSET(count, &read_sd)) {
-				chat(count, sd, user_name);
+		for (i = 0; i < nev; i++) {
+			if (events[i].data.fd == timer_fd) {
+				// Clear the timer. It has expired, so it must be set again even if the deadline hasn't moved.
+				if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+					perror("read");
+				}
+				timer_armed = 0;
+			} else {
+				chat(events[i].data.fd, sd, user_name);
 			}
 		}
+		/* Check if we need to retransmit some packets */
+		check_retrans_timeout(&conn);
+		check_ack_timeout(&conn);
+		if (conn.closed) {
+			fprintf(stderr, "Closing connection: %s.\n", conn.error);
+			bench_lost();
+			exit(1);
+		}
 	}
 	fprintf(stderr, "client got disconnected\n");
 	close(sd);
@@ -4,35 +4,225 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/queue.h>
+#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include "crc32c.h"
 	
 #define MAXBUFFER 1024
 #define MAXWORD 20
 #define MAXTIME 20
-#define SELECT_TIMEOUT (100 * 1000)
+#define MAXPACKET (129+MAXWORD+MAXBUFFER+MAXTIME)	// Largest packet, header included.
+#define DEFAULT_WINDOW 64		// Packets that may be in flight (sent but not acked) at once.
+#define INITIAL_CWND 10			// Congestion window to start with, in packets (as RFC 6928).
+#define RENO_BETA 0.5			// Reno halves the congestion window on a loss.
+#define CUBIC_BETA 0.7			// CUBIC (RFC 8312) reduces it less,
+#define CUBIC_C 0.4			// and then grows it as C * (t - K)^3 + W_max, t in seconds.
+#define INITIAL_RTO (1000 * 1000)	// Microseconds to wait for an ack before the first RTT sample.
+#define MIN_RTO (200 * 1000)		// Bounds on the retransmission timeout, in microseconds.
+#define MAX_RTO (60 * 1000 * 1000)
+#define MIN_PTO (10 * 1000)		// Shortest wait for the acks of the last packets in flight before a tail loss probe, in microseconds (as Linux).
+#define MAX_RETRANS 25			// Retransmissions of one packet before giving up.
+#define DUPACK_THRESHOLD 3		// Duplicate acks that trigger a fast retransmit.
+#define RECOVERY_FAST 1			// Values of in_recovery: after a fast retransmit,
+#define RECOVERY_RTO 2			// or after a retransmission timeout.
+#define MAX_SACK_BLOCKS 4		// Ranges of out of order packets reported in an ack.
+#define ACK_EVERY 2			// Ack at least every this many packets received in order.
+#define ACK_DELAY (40 * 1000)		// Longest an ack is delayed, in microseconds, waiting for another packet (or data to piggyback on).
+#define INBUF_SIZE (4 * MAXBUFFER)	// Typed input waiting for room in the window.
+#define RECVBUF_SIZE (64 * 1024)	// Received data waiting to be split into packets. One recv can fill it with many.
+#define SQ_BUF_INITIAL 4096		// Starting size of a connection's send buffer. It doubles whenever the data in flight needs more.
+#define OUTBUF_MAX (256 * 1024)		// Most a non-blocking connection keeps waiting for room in its socket. Packets beyond that are dropped, like any lost packet.
+#define MAXEVENTS 4			// epoll_wait() batch size: the socket, standard input and the timer.
 
-// An entry in the send queue.
+// Benchmark modes (--send-file, --generate, --sink).
+#define GEN_LINE_SIZE 100		// Length of a generated line, newline included, unless --size says otherwise.
+#define BENCH_END '\004'		// First byte of the line that ends a benchmark: "\004 LINES BYTES CRC32C".
+
+// Congestion control algorithms (-C).
+#define CC_NONE 0			// Always send a whole window.
+#define CC_RENO 1
+#define CC_CUBIC 2
+
+// Header flags. In text headers ("SEQ_NUM,ACK_NUM,FLAGS:") FLAGS is 0 for data packets, so older clients read any other value as a pure ack.
+#define PKT_PURE_ACK 1			// No data, just an ack.
+#define PKT_BINARY_OK 2			// The sender can parse binary headers.
+#define PKT_PIGGYBACK_OK 4		// The sender reads the ack on data packets, and data packet flags. Set on pure acks.
+#define PKT_ACK_NOW 8			// Data packet: ack it without delay, the sender's window is full. Only sent to a client that set PKT_PIGGYBACK_OK.
+
+// Binary header: fixed width fields of digits that carry 6 bits each ('0' + value), so that a header never contains
+// a newline, which the relay would take for the end of a message. All fields are most significant digit first.
+#define BIN_MAGIC '#'			// First byte of a binary packet; text packets start with a decimal digit.
+#define BIN_CRC 1			// CRC32C of the rest of the header and the data (6 digits).
+#define BIN_LEN 7			// Length of the data, which ends with a newline (3 digits).
+#define BIN_SEQ 10			// Sequence number (6 digits).
+#define BIN_ACK 16			// Ack number (6 digits).
+#define BIN_FLAGS 22			// PKT_ flags (1 digit).
+#define BIN_NUM_SACK 23			// Number of SACK blocks that follow (1 digit).
+#define BIN_HEADER_SIZE 24
+#define BIN_SACK_SIZE 12		// A SACK block: left and right edge, 6 digits each.
+#define BIN_DIGIT_BITS 6
+
+// An entry in the send queue. Its data is in the connection's send buffer; the header is built each time it is sent.
 struct sq_entry {
-	TAILQ_ENTRY(sq_entry) entries;		// Linked list pointer.
-	char rp[129+MAXWORD+MAXBUFFER+MAXTIME]; // The actual packet data along with the header.
-	unsigned int seq_num;			// Sequence number of the outgoing packet.
-	time_t tsec;				// The time when the packet was added to the send queue.
-	int sockfd;				// Socket descriptor on which the packet was sent.
+	unsigned long off;			// Where the data starts in the send buffer (see struct conn).
+	int len;				// Length of the data.
+	unsigned long seq_num;			// Sequence number of the outgoing packet.
+	long long sent_us;			// The time when the packet was last sent, in microseconds.
 	int num_retrans;			// The number of times the packet has been retransmitted.
+	int sacked;				// The other client has it, according to a SACK block.
 };
 
 // An entry in the receive queue.
 struct rq_entry {
-	TAILQ_ENTRY(rq_entry) entries;		// Linked list pointer
-	char rp[129+MAXWORD+MAXBUFFER+MAXTIME]; // The actual packet data along with the header.
-	unsigned int seq_num;			// Sequence number of the incoming packet.
+	char *data;				// The packet data, without the header, allocated to size.
+	int len;				// Length of the data.
+};
+
+// A received packet, with its header parsed.
+struct packet {
+	unsigned long seq_num;
+	unsigned long ack_num;
+	int flags;				// PKT_ flags.
+	int num_sack;
+	unsigned long sack[MAX_SACK_BLOCKS][2];	// SACK blocks: the sender has packets sack[i][0] to sack[i][1]-1.
+	char *data;				// The data after the header, ending with a newline.
+	int data_len;
+};
+
+// The state of one connection: everything the protocol engine (proto.c) keeps about it.
+struct conn {
+	int sockfd;
+	int closed;				// conn_fail() gave up on the connection and closed the socket.
+	const char *error;			// Why it did.
+	void (*deliver)(struct conn *c, char *data, int len);	// Called with each packet's data, in order.
+	void *app;				// For whoever drives the connection.
+	// With a non-blocking socket (conn_nonblocking()), packets the socket had no room for wait here, in order, for conn_flush().
+	int nonblocking;
+	char *out_buf;
+	int out_len;
+	int out_size;
+
+	unsigned long next_seq_num;
+	unsigned long expected_seq_num;
+	int window;				// Maximum number of packets waiting for an ack.
+	int num_unacked;			// Packets in the send queue, i.e. sent but not yet acked.
+
+	// Congestion control: how many packets the path can take in flight, worked out from acks and losses like TCP. Never more than window.
+	int cc_algo;
+	double cwnd;
+	double ssthresh;			// Slow start (doubling cwnd every round trip) until cwnd reaches this.
+	double cubic_wmax;			// cwnd before the last reduction.
+	double cubic_k;				// Seconds from the start of the epoch until CUBIC grows cwnd back to cubic_wmax.
+	long long cubic_epoch;			// When cwnd started growing again after a loss, 0 if not yet.
+
+	// The send queue: packets waiting for an ack, in a ring indexed by sequence number.
+	// Slot (seq & sq_mask) holds packet seq, for snd_una <= seq < next_seq_num.
+	struct sq_entry *sq_ring;
+	unsigned long sq_mask;
+	// Their data, one after the other in a ring of bytes, so that each takes only the room it needs. Offsets only grow:
+	// byte off is at sq_buf[off & (sq_buf_size - 1)]. sq_tail is where the oldest packet's data starts, sq_head where the next one's will.
+	char *sq_buf;
+	unsigned long sq_buf_size;
+	unsigned long sq_head;
+	unsigned long sq_tail;
+	unsigned long snd_una;			// Oldest sequence number not acked yet.
+	long long retrans_deadline;		// When the oldest packet is due for retransmission, 0 if nothing is in flight.
+	int retrans_probe;			// retrans_deadline is for a tail loss probe, not a timeout.
+	int probe_sent;				// A tail loss probe has been sent since an ack last acked something new.
+
+	// Loss recovery driven by duplicate acks and SACK blocks.
+	int dup_acks;				// Acks in a row that didn't ack anything new.
+	int in_recovery;			// Retransmitting the packets the SACK blocks show are missing (RECOVERY_FAST or RECOVERY_RTO), 0 if not.
+	unsigned long recover_seq;		// Recovery is over once everything before this is acked.
+	unsigned long sack_high;		// One past the highest packet the other client has SACKed.
+	unsigned long hole_seq;			// Next packet to check for a hole to retransmit during recovery.
+	int sacked_out;				// Packets in the send queue that the other client has SACKed.
+	long long sack_sent_us;			// When the last sent of the packets the other client has acked or SACKed was sent.
+
+	// Delayed acks: packets received in order since we last sent our ack, and when we must send it anyway (0 if none is waiting).
+	int ack_pending;
+	long long ack_deadline;
+
+	// Round trip time estimates (Jacobson/Karels), and the retransmission timeout worked out from them. All in microseconds.
+	long long srtt;
+	long long rttvar;
+	long long rto;
+	int backoff;				// Timeouts since the last ack that acked something new. Each one doubles the timeout.
+	unsigned long rtt_seq;			// Packets before this one were in flight during a retransmission, so are not timed.
+
+	int use_binary;				// Send binary headers once the other client says it can parse them (-B).
+	int binary_peer;			// The other client can parse binary headers.
+	int piggyback_peer;			// The other client reads acks piggybacked on data, so we don't need pure acks when sending data.
+
+	// Data received from the server that hasn't been processed yet: whole packets, then maybe the start of one. Packets end with a newline.
+	char recv_buf[RECVBUF_SIZE+1];		// One spare byte, to NUL terminate a packet at the end in place.
+	int recv_len;
+	int recv_skipping;			// Dropping the rest of an overlong line, up to its newline.
+
+	// The receive queue: packets that arrived ahead of a missing one, in a ring indexed by sequence number like the send queue.
+	// Slot (seq & rq_mask) holds packet seq, for expected_seq_num < seq < expected_seq_num + rq_mask + 1, if bit (seq & rq_mask) of rq_present is set.
+	struct rq_entry *rq_ring;
+	unsigned long long *rq_present;
+	unsigned long rq_mask;
+	unsigned long rq_high;			// One past the highest packet in the receive queue, or expected_seq_num if it is empty.
+
+	unsigned long retrans_count;		// Retransmissions sent.
+	unsigned long dup_count;		// Packets received that we had already.
 };
 
+// The engine logs every packet to stderr, unless log_enabled is cleared (as the load generator does).
+extern int log_enabled;
+#define LOG(...) do { if (log_enabled) fprintf(stderr, __VA_ARGS__); } while (0)
+
+// proto.c
+void conn_init(struct conn *c, int sockfd, int window, int cc_algo, int use_binary);
+void conn_fail(struct conn *c, const char *why);
+int conn_recv(struct conn *c);
+struct sq_entry *conn_send(struct conn *c, char *data, int len);
+int conn_nonblocking(struct conn *c);
+int conn_flush(struct conn *c);
+long long now_us();
+void rtt_sample(struct conn *c, long long rtt);
+void init_send_queue(struct conn *c);
+int send_room(struct conn *c);
+void cwnd_acked(struct conn *c, int acked, long long now);
+void cwnd_loss(struct conn *c, int timeout);
+void init_recv_queue(struct conn *c);
+int rq_add(struct conn *c, unsigned long seq, char *data, int len);
+void rq_drain(struct conn *c);
+void set_retrans_timer(struct conn *c, long long now);
+void retransmit_packet(struct conn *c, struct sq_entry *sn1, long long now);
+void send_entry(struct conn *c, struct sq_entry *entry, int flags);
+void retransmit_holes(struct conn *c, long long now);
+int process_sack(struct conn *c, struct packet *p);
+int sack_blocks(struct conn *c, unsigned long sack[][2]);
+int format_packet(struct conn *c, char *buf, unsigned long seq, unsigned long ack, int flags, unsigned long sack[][2], int num_sack, char *data, int data_len);
+int parse_text_packet(char *packet, int pkt_size, struct packet *p);
+int parse_binary_packet(char *packet, int pkt_size, struct packet *p);
+int process_recv_packet(struct conn *c, char *packet, int pkt_size);
+int frame_length(char *buf, int len);
+void process_recv_buf(struct conn *c);
+void send_ack(struct conn *c, unsigned long ack);
+void delay_ack(struct conn *c, long long now);
+void piggybacked_ack(struct conn *c);
+void flush_ack(struct conn *c);
+void check_ack_timeout(struct conn *c);
+void process_ack(struct conn *c, struct packet *p);
+void check_retrans_timeout(struct conn *c);
+long long next_deadline(struct conn *c);
+struct sq_entry *add_to_send_queue(struct conn *c, char *buffer, int pl_size);
+void send_packet(struct conn *c, char *pkt, int len);
+
+// client.c
 void chat(int i, int sd,char *user_name);		
 void connect_server(int *sd, struct sockaddr_in *server_addr, char * server, int port);
 void broadcast_message(int j, int i, int sd, int nbytes_recvd, char *recv_buf, fd_set *master);
@@ -40,5 +230,12 @@ void message_send(int i, fd_set *server, int sd, int max_sd);
 void accept_connection(fd_set *server, int *fdmax, int sd, struct sockaddr_in *client_addr);
 void create_listener(int *sd, struct sockaddr_in *my_addr);
 void add_user_time(char *Buffer,int user);
-void check_retrans_timeout();
-struct sq_entry *add_to_send_queue(int sockfd, char *buffer, int pl_size);
+void arm_timer();
+void watch_input(int on);
+void send_pending_input();
+void read_input();
+void generate_input();
+void deliver(struct conn *c, char *data, int len);
+void bench_report(int done);
+void bench_check_done();
+void bench_lost();
@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78		// The Castagnoli polynomial, bit reversed.
+
+// x86-64 has had a CRC32C instruction since SSE4.2. It is only used if the CPU running the client has it.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+// crc32c_table[0] is the checksum of every byte value, for processing a byte at a time.
+// crc32c_table[k] is the same for a byte followed by k zero bytes, for processing 8 bytes at a time ("slicing by 8").
+static uint32_t crc32c_table[8][256];
+
+static unsigned int crc32c_sw(unsigned int crc, const void *buf, size_t len);
+static unsigned int (*crc32c_fn)(unsigned int crc, const void *buf, size_t len) = crc32c_sw;
+const char *crc32c_impl = "table";
+
+static unsigned int crc32c_sw(unsigned int crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t lo;
+
+	crc = ~crc;
+	while (len >= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+		      crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	}
+	return ~crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+// One crc32 instruction per 8 bytes. Compiled for SSE4.2 whatever the compiler flags, as it is only called if the CPU has it.
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t crc64, word;
+
+	crc = ~crc;
+	crc64 = crc;
+	while (len >= 8) {
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (len--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return ~crc;
+}
+#endif
+
+// Build the tables and pick the fastest version the CPU supports, before main() runs (so before any threads start).
+__attribute__((constructor))
+static void crc32c_init()
+{
+	uint32_t crc;
+	int i, k, bit;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			crc = crc32c_table[k-1][i];
+			crc32c_table[k][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+		}
+	}
+#ifdef CRC32C_HAVE_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_fn = crc32c_sse42;
+		crc32c_impl = "sse4.2";
+	}
+#endif
+}
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+	return crc32c_fn(crc, buf, len);
+}
@@ -0,0 +1,8 @@
+#include <stddef.h>
+
+// CRC32C (the Castagnoli polynomial, as used by iSCSI, SCTP and ext4).
+// crc32c(0, buf, len) gives the checksum of a buffer; passing a checksum back in as crc continues it over more data.
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+
+// Which version crc32c() uses: "sse4.2" if the CPU has the CRC32C instruction, else "table".
+extern const char *crc32c_impl;
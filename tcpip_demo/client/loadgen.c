@@ -0,0 +1,608 @@
+/* Load generator: many simulated chat clients, driven with the client's protocol engine (proto.c), to load-test the relay.
+ * The connections are spread over a few threads. Each thread runs an epoll loop and one timerfd for all its connections,
+ * set to the earliest of their deadlines (retransmissions, delayed acks and messages due), which a heap keeps in order.
+ * Every connection sends messages of random size at random times. It sends them "open loop": a message is due at its
+ * time whether or not the window has room, so the time a message waits for the window counts in its latency.
+ * Each message starts with the time it was due, and the connection that receives it records, in a histogram of its own,
+ * how long it took to be delivered in order. The relay pairs the connections with each other, and all of them are in
+ * this process, so both times come from the same clock whichever two connections it pairs.
+ * The sockets are non-blocking, so a connection whose socket is full can't hold up the rest of its thread: its packets
+ * wait in its own queue (out_buf in struct conn) until epoll says the socket has room again.
+ */
+#include <pthread.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include "client_header.h"
+#include "urs-hist.h"		// Latency histogram buckets, the same as the relay's.
+
+#define DIST_FIXED 0			// Distributions for -s and -r: "N",
+#define DIST_UNIFORM 1			// "A-B",
+#define DIST_EXP 2			// or "exp:MEAN".
+#define MSG_STAMP 17			// A message starts with the time it was due: 16 hex digits and a space.
+#define MIN_MSG_SIZE (MSG_STAMP + 1)	// That and the newline.
+#define DRAIN_TIME (5 * 1000 * 1000)	// After the run, how long to wait for the messages in flight to be acked, in microseconds.
+#define DRAIN_CHECK (10 * 1000)		// While waiting, how often threads check whether all the others are done.
+#define LG_MAXEVENTS 64			// epoll_wait() batch size.
+
+struct dist {
+	int kind;
+	double a, b;
+};
+
+// A simulated client.
+struct lg_conn {
+	struct conn c;
+	int id;
+	struct lg_thread *thread;
+	double rate;				// Messages per second.
+	long long next_send;			// When the next message is due, 0 once the run is over.
+	long long deadline;			// Its key in the thread's heap: when it next needs attention.
+	int heap_idx;
+	int watch_out;				// EPOLLOUT is in the epoll set: packets are waiting for room in the socket.
+	int finished;				// Counted as done in lg_active.
+	unsigned long long rng;
+	unsigned long sent, received;
+	unsigned long long bytes_sent, bytes_received;
+	unsigned int hist[HIST_BUCKETS];	// Latency of the messages it received.
+};
+
+struct lg_thread {
+	pthread_t tid;
+	int epfd;
+	int timer_fd;
+	long long timer_armed;			// The time timer_fd is set to, 0 if it is stopped.
+	struct lg_conn **heap;			// The thread's connections, the one that next needs attention first.
+	int nconns;
+};
+
+int parse_dist(char *arg, struct dist *d);
+double dist_sample(struct dist *d, unsigned long long *rng);
+double rng_uniform(unsigned long long *rng);
+unsigned long long percentile(unsigned int *hist, double p);
+void lg_deliver(struct conn *c, char *data, int len);
+void send_due(struct lg_conn *lc, long long now);
+long long conn_deadline(struct lg_conn *lc);
+void heap_fix(struct lg_thread *t, struct lg_conn *lc);
+void finish_check(struct lg_conn *lc);
+void watch_out(struct lg_conn *lc);
+void *lg_thread_main(void *arg);
+void report(struct lg_conn *conns, int nconns, double secs, int verbose);
+
+struct dist size_dist = {DIST_FIXED, 100, 0};
+struct dist rate_dist = {DIST_FIXED, 10, 0};
+long long stop_at;				// When connections stop sending.
+int lg_active;					// Connections whose messages haven't all been acked yet (atomic).
+
+int main(int argc, char *argv[])
+{
+	int nconns = 100, nthreads = 4, duration = 10, window = DEFAULT_WINDOW, cc_algo = CC_RENO, use_binary = 0;
+	int verbose = 0, seed = 1, one = 1;
+	int i, sd, opt;
+	struct sockaddr_in server_addr;
+	struct epoll_event ev;
+	struct rlimit rl;
+	struct lg_conn *conns, *lc;
+	struct lg_thread *threads, *t;
+	long long start;
+
+	while ((opt = getopt(argc, argv, "n:t:d:s:r:w:BC:S:vh")) != -1) {
+		switch (opt) {
+		case 'n':
+			nconns = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			if (parse_dist(optarg, &size_dist) < 0) {
+				fprintf(stderr, "Bad message size \"%s\".\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'r':
+			if (parse_dist(optarg, &rate_dist) < 0) {
+				fprintf(stderr, "Bad message rate \"%s\".\n", optarg);
+				exit(-1);
+			}
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'B':
+			use_binary = 1;
+			break;
+		case 'C':
+			if (strcmp(optarg, "reno") == 0) {
+				cc_algo = CC_RENO;
+			} else if (strcmp(optarg, "cubic") == 0) {
+				cc_algo = CC_CUBIC;
+			} else if (strcmp(optarg, "none") == 0) {
+				cc_algo = CC_NONE;
+			} else {
+				fprintf(stderr, "Congestion control must be reno, cubic or none.\n");
+				exit(-1);
+			}
+			break;
+		case 'S':
+			seed = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [options] <server_ip> <port_no>\n", argv[0]);
+			fprintf(stderr, "Run many chat clients through the relay, and report throughput and latency.\n");
+			fprintf(stderr, " -n n     Connections (default 100). The relay pairs them, so n must be even.\n");
+			fprintf(stderr, " -t n     Threads to spread them over (default 4).\n");
+			fprintf(stderr, " -d s     Send for s seconds (default 10).\n");
+			fprintf(stderr, " -s dist  Message size in bytes, newline included (default 100).\n");
+			fprintf(stderr, " -r dist  Messages per second for each connection (default 10).\n");
+			fprintf(stderr, "          dist is N, A-B (uniform) or exp:MEAN. For -r, A-B gives each connection its own rate,\n");
+			fprintf(stderr, "          and exp:R sends at random times (a Poisson process) at R per second.\n");
+			fprintf(stderr, " -w n     Window, as for the client (default %d).\n", DEFAULT_WINDOW);
+			fprintf(stderr, " -B       Binary headers, as for the client.\n");
+			fprintf(stderr, " -C algo  Congestion control, as for the client: reno (default), cubic or none.\n");
+			fprintf(stderr, " -S n     Seed for the sizes and times (default 1).\n");
+			fprintf(stderr, " -v       Report on every connection too.\n");
+			exit(-1);
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "Usage: %s [options] <server_ip> <port_no>\n", argv[0]);
+		exit(-1);
+	}
+	if (nconns < 2 || nconns % 2 != 0 || nthreads < 1 || duration < 1 || window < 1) {
+		fprintf(stderr, "Need an even number of connections, and at least one thread, second and packet of window.\n");
+		exit(-1);
+	}
+	if (nthreads > nconns) {
+		nthreads = nconns;
+	}
+	if (size_dist.a < MIN_MSG_SIZE || size_dist.a > MAXBUFFER - 1 || (size_dist.kind == DIST_UNIFORM && size_dist.b > MAXBUFFER - 1)) {
+		fprintf(stderr, "Messages must be %d to %d bytes.\n", MIN_MSG_SIZE, MAXBUFFER - 1);
+		exit(-1);
+	}
+	// Thousands of connections need as many file descriptors.
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	// Thousands of connections would log millions of lines.
+	log_enabled = 0;
+
+	conns = calloc(nconns, sizeof(struct lg_conn));
+	threads = calloc(nthreads, sizeof(struct lg_thread));
+	if (!conns || !threads) {
+		fprintf(stderr, "Out of memory for %d connections.\n", nconns);
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++) {
+		t = &threads[i];
+		t->epfd = epoll_create1(0);
+		t->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		t->heap = malloc((nconns / nthreads + 1) * sizeof(struct lg_conn *));
+		if (t->epfd == -1 || t->timer_fd == -1 || !t->heap) {
+			perror("epoll_create1/timerfd_create");
+			exit(1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->timer_fd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	// Connect them all before any sends, one after the other, so the relay has paired them all by then.
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(atoi(argv[optind+1]));
+	server_addr.sin_addr.s_addr = inet_addr(argv[optind]);
+	for (i = 0; i < nconns; i++) {
+		lc = &conns[i];
+		sd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sd == -1 || connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+			fprintf(stderr, "Connection %d: ", i);
+			perror("connect");
+			exit(1);
+		}
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn_init(&lc->c, sd, window, cc_algo, use_binary);
+		if (conn_nonblocking(&lc->c) < 0) {
+			perror("fcntl");
+			exit(1);
+		}
+		lc->c.deliver = lg_deliver;
+		lc->c.app = lc;
+		lc->id = i;
+		lc->rng = ((unsigned long long)seed << 32 | i) * 0x9e3779b97f4a7c15ULL + 1;
+		lc->rate = dist_sample(&rate_dist, &lc->rng);
+		if (rate_dist.kind == DIST_EXP) {
+			// exp:R is R per second at random times, rather than a random rate.
+			lc->rate = rate_dist.a;
+		}
+		t = &threads[i % nthreads];
+		lc->thread = t;
+		lc->heap_idx = t->nconns;
+		t->heap[t->nconns++] = lc;
+		ev.events = EPOLLIN;
+		ev.data.ptr = lc;
+		if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, sd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	fprintf(stderr, "%d connections on %d threads to %s:%s for %d s.\n", nconns, nthreads, argv[optind], argv[optind+1], duration);
+
+	start = now_us();
+	stop_at = start + duration * 1000000LL;
+	lg_active = nconns;
+	for (i = 0; i < nconns; i++) {
+		lc = &conns[i];
+		// Spread the first messages over the first interval, so the connections don't all send at once.
+		lc->next_send = start + (long long)(rng_uniform(&lc->rng) * 1e6 / lc->rate) + 1;
+		if (lc->next_send >= stop_at) {
+			lc->next_send = 0;
+		}
+		if (use_binary) {
+			// Tell the other client we can parse binary headers.
+			send_ack(&lc->c, 0);
+			watch_out(lc);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i].tid, NULL, lg_thread_main, &threads[i]) != 0) {
+			fprintf(stderr, "pthread_create failed.\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].tid, NULL);
+	}
+	report(conns, nconns, duration, verbose);
+	return 0;
+}
+
+// Parse "N", "A-B" or "exp:MEAN". Returns -1 if it is none of them.
+int parse_dist(char *arg, struct dist *d)
+{
+	char *end;
+
+	if (strncmp(arg, "exp:", 4) == 0) {
+		d->kind = DIST_EXP;
+		d->a = strtod(arg + 4, &end);
+	} else {
+		d->a = strtod(arg, &end);
+		d->kind = DIST_FIXED;
+		if (*end == '-') {
+			d->kind = DIST_UNIFORM;
+			d->b = strtod(end + 1, &end);
+			if (d->b < d->a) {
+				return -1;
+			}
+		}
+	}
+	return *end == '\0' && d->a > 0 ? 0 : -1;
+}
+
+// Uniform in [0, 1), from xorshift64*.
+double rng_uniform(unsigned long long *rng)
+{
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return (*rng * 0x2545f4914f6cdd1dULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+double dist_sample(struct dist *d, unsigned long long *rng)
+{
+	switch (d->kind) {
+	case DIST_UNIFORM:
+		return d->a + (d->b - d->a) * rng_uniform(rng);
+	case DIST_EXP:
+		return -d->a * log(1 - rng_uniform(rng));
+	default:
+		return d->a;
+	}
+}
+
+// Value below which a fraction p of the recorded values fall (to within a bucket).
+unsigned long long percentile(unsigned int *hist, double p)
+{
+	unsigned long long total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		total += hist[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= p * total) {
+			return hist_value(i);
+		}
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+// A message was delivered in order: record how long it took from the time it was due.
+void lg_deliver(struct conn *c, char *data, int len)
+{
+	struct lg_conn *lc = c->app;
+	long long due;
+
+	lc->received++;
+	lc->bytes_received += len;
+	if (len < MSG_STAMP) {
+		return;
+	}
+	due = strtoll(data, NULL, 16);
+	if (due > 0) {
+		lc->hist[hist_bucket(now_us() - due)]++;
+	}
+}
+
+// Send the messages that are due, as far as the window allows.
+void send_due(struct lg_conn *lc, long long now)
+{
+	char buffer[MAXBUFFER];
+	int len, i;
+
+	while (lc->next_send != 0 && lc->next_send <= now && send_room(&lc->c) > 0 && !lc->c.closed) {
+		len = dist_sample(&size_dist, &lc->rng);
+		if (len < MIN_MSG_SIZE) {
+			len = MIN_MSG_SIZE;
+		} else if (len > MAXBUFFER - 1) {
+			len = MAXBUFFER - 1;
+		}
+		sprintf(buffer, "%016llx ", lc->next_send);
+		for (i = MSG_STAMP; i < len - 1; i++) {
+			buffer[i] = 'a' + i % 26;
+		}
+		buffer[len - 1] = '\n';
+		if (!conn_send(&lc->c, buffer, len)) {
+			fprintf(stderr, "Out of memory for the send queue.\n");
+			exit(1);
+		}
+		lc->sent++;
+		lc->bytes_sent += len;
+		if (rate_dist.kind == DIST_EXP) {
+			lc->next_send += (long long)(-log(1 - rng_uniform(&lc->rng)) * 1e6 / lc->rate) + 1;
+		} else {
+			lc->next_send += (long long)(1e6 / lc->rate) + 1;
+		}
+		if (lc->next_send >= stop_at) {
+			lc->next_send = 0;
+		}
+	}
+}
+
+// When a connection next needs attention: a retransmission or delayed ack, or a message due if the window has room for it.
+long long conn_deadline(struct lg_conn *lc)
+{
+	long long deadline;
+
+	if (lc->c.closed) {
+		return LLONG_MAX;
+	}
+	deadline = next_deadline(&lc->c);
+	if (deadline == 0) {
+		deadline = LLONG_MAX;
+	}
+	if (lc->next_send != 0 && lc->next_send < deadline && send_room(&lc->c) > 0) {
+		deadline = lc->next_send;
+	}
+	return deadline;
+}
+
+static void heap_swap(struct lg_thread *t, int i, int j)
+{
+	struct lg_conn *tmp = t->heap[i];
+
+	t->heap[i] = t->heap[j];
+	t->heap[j] = tmp;
+	t->heap[i]->heap_idx = i;
+	t->heap[j]->heap_idx = j;
+}
+
+// Work out a connection's deadline again, and move it to its place in the heap.
+void heap_fix(struct lg_thread *t, struct lg_conn *lc)
+{
+	int i = lc->heap_idx, child;
+
+	lc->deadline = conn_deadline(lc);
+	while (i > 0 && t->heap[(i - 1) / 2]->deadline > lc->deadline) {
+		heap_swap(t, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < t->nconns) {
+		if (child + 1 < t->nconns && t->heap[child + 1]->deadline < t->heap[child]->deadline) {
+			child++;
+		}
+		if (t->heap[child]->deadline >= lc->deadline) {
+			break;
+		}
+		heap_swap(t, i, child);
+		i = child;
+	}
+}
+
+// Once the run is over, a connection is done when all it sent has been acked (or it failed).
+void finish_check(struct lg_conn *lc)
+{
+	if (!lc->finished && lc->next_send == 0 &&
+	    (lc->c.closed || lc->c.snd_una == lc->c.next_seq_num)) {
+		lc->finished = 1;
+		__atomic_sub_fetch(&lg_active, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Watch for room in the socket only while packets are waiting for it, as a socket with room is nearly always writable.
+void watch_out(struct lg_conn *lc)
+{
+	struct epoll_event ev;
+	int want;
+
+	if (lc->c.closed) {
+		// Closing the socket took it out of the epoll set.
+		lc->watch_out = 0;
+		return;
+	}
+	want = lc->c.out_len > 0;
+	if (want == lc->watch_out) {
+		return;
+	}
+	ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = lc;
+	if (epoll_ctl(lc->thread->epfd, EPOLL_CTL_MOD, lc->c.sockfd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+	lc->watch_out = want;
+}
+
+void *lg_thread_main(void *arg)
+{
+	struct lg_thread *t = arg;
+	struct epoll_event events[LG_MAXEVENTS];
+	struct itimerspec its;
+	struct lg_conn *lc;
+	unsigned long long expirations;
+	long long now, wake;
+	int i, n, nev;
+
+	// Build the heap by adding the connections one at a time.
+	n = t->nconns;
+	for (i = 0; i < n; i++) {
+		t->nconns = i + 1;
+		finish_check(t->heap[i]);
+		heap_fix(t, t->heap[i]);
+	}
+	while (1) {
+		now = now_us();
+		// Serve the connections whose deadlines have come.
+		while (t->heap[0]->deadline <= now) {
+			lc = t->heap[0];
+			check_retrans_timeout(&lc->c);
+			check_ack_timeout(&lc->c);
+			send_due(lc, now);
+			finish_check(lc);
+			watch_out(lc);
+			heap_fix(t, lc);
+		}
+		if (now >= stop_at) {
+			if (__atomic_load_n(&lg_active, __ATOMIC_RELAXED) == 0 || now >= stop_at + DRAIN_TIME) {
+				break;
+			}
+			// Keep acking for the other threads' connections until they are all done too.
+			wake = now + DRAIN_CHECK;
+		} else {
+			wake = stop_at;
+		}
+		if (t->heap[0]->deadline < wake) {
+			wake = t->heap[0]->deadline;
+		}
+		if (wake != t->timer_armed) {
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = wake / 1000000;
+			its.it_value.tv_nsec = wake % 1000000 * 1000;
+			timerfd_settime(t->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+			t->timer_armed = wake;
+		}
+		nev = epoll_wait(t->epfd, events, LG_MAXEVENTS, -1);
+		if (nev == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i = 0; i < nev; i++) {
+			lc = events[i].data.ptr;
+			if (lc == NULL) {
+				if (read(t->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+					perror("read");
+				}
+				t->timer_armed = 0;
+				continue;
+			}
+			if (events[i].events & EPOLLOUT) {
+				conn_flush(&lc->c);
+			}
+			if (!lc->c.closed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+				n = conn_recv(&lc->c);
+				if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+					// The relay closed it, e.g. because the other end of the session failed.
+					conn_fail(&lc->c, "disconnected");
+				}
+			}
+			if (!lc->c.closed) {
+				// Acks may have opened the window for messages that are due.
+				send_due(lc, now_us());
+				flush_ack(&lc->c);
+			}
+			finish_check(lc);
+			watch_out(lc);
+			heap_fix(t, lc);
+		}
+	}
+	return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void report(struct lg_conn *conns, int nconns, double secs, int verbose)
+{
+	static unsigned int all[HIST_BUCKETS];
+	unsigned long long sent = 0, received = 0, bytes_sent = 0, bytes_received = 0, packets = 0, retrans = 0, dups = 0;
+	unsigned long long *conn_p99;
+	struct lg_conn *lc;
+	int i, j, failed = 0, worst = 0;
+
+	conn_p99 = malloc(nconns * sizeof(unsigned long long));
+	for (i = 0; i < nconns; i++) {
+		lc = &conns[i];
+		sent += lc->sent;
+		received += lc->received;
+		bytes_sent += lc->bytes_sent;
+		bytes_received += lc->bytes_received;
+		packets += lc->c.next_seq_num;
+		retrans += lc->c.retrans_count;
+		dups += lc->c.dup_count;
+		failed += lc->c.closed;
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			all[j] += lc->hist[j];
+		}
+		conn_p99[i] = percentile(lc->hist, 0.99);
+		if (conn_p99[i] > conn_p99[worst]) {
+			worst = i;
+		}
+		if (verbose) {
+			printf("conn %d: sent %lu received %lu retrans %lu dups %lu cwnd %.1f srtt %lld us latency us p50:%llu p99:%llu max:%llu%s%s\n",
+			       i, lc->sent, lc->received, lc->c.retrans_count, lc->c.dup_count, lc->c.cwnd, lc->c.srtt,
+			       percentile(lc->hist, 0.5), conn_p99[i], percentile(lc->hist, 1.0),
+			       lc->c.closed ? " failed: " : "", lc->c.closed ? lc->c.error : "");
+		}
+	}
+	printf("connections:%d failed:%d\n", nconns, failed);
+	printf("  sent:     %llu msgs %llu bytes (%.0f msgs/s %.0f bytes/s)\n", sent, bytes_sent, sent / secs, bytes_sent / secs);
+	printf("  received: %llu msgs %llu bytes (%llu not delivered)\n", received, bytes_received, sent - received);
+	printf("  packets:%llu retransmissions:%llu (%.2f%%) duplicates received:%llu\n",
+	       packets, retrans, packets ? 100.0 * retrans / packets : 0.0, dups);
+	printf("  latency us: p50:%llu p90:%llu p99:%llu p99.9:%llu max:%llu\n",
+	       percentile(all, 0.5), percentile(all, 0.9), percentile(all, 0.99), percentile(all, 0.999), percentile(all, 1.0));
+	// How evenly the connections fared: the spread of their own p99s.
+	qsort(conn_p99, nconns, sizeof(unsigned long long), cmp_ull);
+	printf("  per-connection p99 us: min:%llu median:%llu max:%llu (conn %d)\n",
+	       conn_p99[0], conn_p99[nconns / 2], conn_p99[nconns - 1], worst);
+	free(conn_p99);
+}
@@ -0,0 +1,1075 @@
+/* The protocol engine: reliable, ordered delivery of lines over the relay, for one connection (struct conn).
+ * client.c drives a single connection with it, loadgen.c thousands. Nothing here touches global state,
+ * so connections can be driven from different threads as long as each one stays on its own thread.
+ */
+#include "client_header.h"
+
+int log_enabled = 1;
+
+// Set up a connection on a connected socket: window packets may be in flight, with congestion control cc_algo, and binary headers if use_binary.
+void conn_init(struct conn *c, int sockfd, int window, int cc_algo, int use_binary)
+{
+	memset(c, 0, sizeof(*c));
+	c->sockfd = sockfd;
+	c->window = window;
+	c->cc_algo = cc_algo;
+	c->use_binary = use_binary;
+	c->cwnd = INITIAL_CWND;
+	// Slow start until the first loss, or until the window is full.
+	c->ssthresh = window;
+	c->rto = INITIAL_RTO;
+	//Initalize the send queue and the receive queue.
+	init_send_queue(c);
+	init_recv_queue(c);
+}
+
+// Give up on a connection: close its socket, and tell whoever drives it by setting c->closed (c->error says why).
+void conn_fail(struct conn *c, const char *why)
+{
+	if (c->closed) {
+		return;
+	}
+	LOG("Closing connection: %s.\n", why);
+	close(c->sockfd);
+	c->closed = 1;
+	c->error = why;
+	c->out_len = 0;
+}
+
+// Make the socket non-blocking, for a caller that drives many connections and can't wait for any one of them.
+// Packets the socket has no room for are then kept in out_buf, and the caller calls conn_flush() when the socket is writable again (while out_len > 0). Returns -1 on error.
+int conn_nonblocking(struct conn *c)
+{
+	int flags;
+
+	flags = fcntl(c->sockfd, F_GETFL, 0);
+	if (flags == -1 || fcntl(c->sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	c->nonblocking = 1;
+	return 0;
+}
+
+// Send what the socket had no room for before. Returns how many bytes are still waiting.
+int conn_flush(struct conn *c)
+{
+	int n, sent = 0;
+
+	while (sent < c->out_len && !c->closed) {
+		n = send(c->sockfd, c->out_buf + sent, c->out_len - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				conn_fail(c, strerror(errno));
+			}
+			break;
+		}
+		sent += n;
+	}
+	if (c->closed) {
+		return 0;
+	}
+	memmove(c->out_buf, c->out_buf + sent, c->out_len - sent);
+	c->out_len -= sent;
+	return c->out_len;
+}
+
+// Keep (the rest of) a packet in out_buf, after what is there already. Returns -1 if that would be more than OUTBUF_MAX, or there is no memory for it.
+static int out_queue(struct conn *c, char *pkt, int len)
+{
+	char *buf;
+	int size;
+
+	if (c->out_len + len > OUTBUF_MAX) {
+		return -1;
+	}
+	if (c->out_len + len > c->out_size) {
+		size = c->out_size ? c->out_size : 4096;
+		while (size < c->out_len + len) {
+			size *= 2;
+		}
+		buf = realloc(c->out_buf, size);
+		if (!buf) {
+			return -1;
+		}
+		c->out_buf = buf;
+		c->out_size = size;
+	}
+	memcpy(c->out_buf + c->out_len, pkt, len);
+	c->out_len += len;
+	return 0;
+}
+
+// Read what has arrived on the socket and process the whole packets in it. Returns what recv returned: 0 if the other end closed the connection, -1 on an error.
+int conn_recv(struct conn *c)
+{
+	int n;
+
+	//Receive the data. The buffer holds many packets, so with a window of packets in flight one recv usually gets several.
+	n = recv(c->sockfd, c->recv_buf + c->recv_len, RECVBUF_SIZE - c->recv_len, 0);
+	if (n <= 0) {
+		return n;
+	}
+	c->recv_len += n;
+	// Analyze and Process the data received.
+	process_recv_buf(c);
+	return n;
+}
+
+// Queue a line of data and send it. The caller checks send_room() first. Returns the send queue entry, or NULL if there is no memory for one.
+struct sq_entry *conn_send(struct conn *c, char *data, int len)
+{
+	struct sq_entry *sentry;
+	int flags;
+
+	// If this packet fills the window, ask for an ack right away rather than waiting for the other client's delayed ack timer.
+	flags = c->piggyback_peer && send_room(c) <= 1 ? PKT_ACK_NOW : 0;
+	// Add this packet to the send buffer queue before sending it on network.
+	sentry = add_to_send_queue(c, data, len);
+	if (!sentry) {
+		return NULL;
+	}
+	// Send the packet on network.
+	send_entry(c, sentry, flags);
+	return sentry;
+}
+
+// Current time in microseconds. The monotonic clock doesn't jump when the system time is set.
+long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Update the round trip time estimates with a new measurement, as in RFC 6298, and work out a new retransmission timeout.
+void rtt_sample(struct conn *c, long long rtt)
+{
+	long long delta;
+
+	if (c->srtt == 0) {
+		// First measurement.
+		c->srtt = rtt;
+		c->rttvar = rtt / 2;
+	} else {
+		delta = c->srtt > rtt ? c->srtt - rtt : rtt - c->srtt;
+		c->rttvar += (delta - c->rttvar) / 4;
+		c->srtt += (rtt - c->srtt) / 8;
+	}
+	c->rto = c->srtt + 4 * c->rttvar;
+	if (c->rto < MIN_RTO) {
+		c->rto = MIN_RTO;
+	} else if (c->rto > MAX_RTO) {
+		c->rto = MAX_RTO;
+	}
+}
+
+// Allocate the send queue ring, big enough for a full window, and a small buffer for the data, which grows as needed.
+void init_send_queue(struct conn *c)
+{
+	unsigned long size = 1;
+
+	while (size < (unsigned long)c->window) {
+		size *= 2;
+	}
+	c->sq_ring = calloc(size, sizeof(struct sq_entry));
+	c->sq_buf = malloc(SQ_BUF_INITIAL);
+	c->sq_buf_size = SQ_BUF_INITIAL;
+	if (!c->sq_ring || !c->sq_buf) {
+		fprintf(stderr, "Out of memory for the send queue.\n");
+		exit(1);
+	}
+	c->sq_mask = size - 1;
+	// Offsets start at 1, so that sq_alloc can return 0 for failure.
+	c->sq_head = 1;
+	c->sq_tail = 1;
+}
+
+// Allocate the receive queue ring, with room for packets up to a window ahead of the one we expect next.
+// At least 64 slots, so the bitmap of present packets is whole words.
+void init_recv_queue(struct conn *c)
+{
+	unsigned long size = 64;
+
+	while (size < (unsigned long)c->window) {
+		size *= 2;
+	}
+	c->rq_ring = calloc(size, sizeof(struct rq_entry));
+	c->rq_present = calloc(size / 64, sizeof(unsigned long long));
+	if (!c->rq_ring || !c->rq_present) {
+		fprintf(stderr, "Out of memory for the receive queue.\n");
+		exit(1);
+	}
+	c->rq_mask = size - 1;
+	c->rq_high = c->expected_seq_num;
+}
+
+static int rq_has(struct conn *c, unsigned long seq)
+{
+	return (c->rq_present[(seq & c->rq_mask) / 64] >> (seq & 63)) & 1;
+}
+
+// First packet from seq up to end that is in the receive queue (present) or missing from it (!present), or end if there is none.
+static unsigned long rq_find(struct conn *c, unsigned long seq, unsigned long end, int present)
+{
+	unsigned long long word;
+
+	while (seq < end) {
+		word = c->rq_present[(seq & c->rq_mask) / 64];
+		if (!present) {
+			word = ~word;
+		}
+		word >>= seq & 63;
+		if (word != 0) {
+			seq += __builtin_ctzll(word);
+			return seq < end ? seq : end;
+		}
+		seq += 64 - (seq & 63);
+	}
+	return end;
+}
+
+// Keep a packet that arrived ahead of expected_seq_num. Returns 1 if it was added, 0 if we have it already, it is too far ahead to keep or there is no memory for it.
+int rq_add(struct conn *c, unsigned long seq, char *data, int len)
+{
+	struct rq_entry *entry;
+
+	if (seq - c->expected_seq_num > c->rq_mask) {
+		LOG("Sequence number %lu is beyond the receive queue.\n", seq);
+		return 0;
+	}
+	if (rq_has(c, seq)) {
+		LOG("Sequence number %lu already present. Possible duplicate.\n", seq);
+		c->dup_count++;
+		return 0;
+	}
+	entry = &c->rq_ring[seq & c->rq_mask];
+	// Only packets that arrive out of order are kept, so a copy of just what each one needs is cheaper than a buffer for every slot.
+	entry->data = malloc(len);
+	if (!entry->data) {
+		LOG("Out of memory for sequence number %lu.\n", seq);
+		return 0;
+	}
+	memcpy(entry->data, data, len);
+	entry->len = len;
+	c->rq_present[(seq & c->rq_mask) / 64] |= 1ULL << (seq & 63);
+	if (seq >= c->rq_high) {
+		c->rq_high = seq + 1;
+	}
+	return 1;
+}
+
+// Hand the packets in the receive queue that follow on from expected_seq_num to the user.
+void rq_drain(struct conn *c)
+{
+	struct rq_entry *entry;
+
+	while (rq_has(c, c->expected_seq_num)) {
+		entry = &c->rq_ring[c->expected_seq_num & c->rq_mask];
+		c->deliver(c, entry->data, entry->len);
+		free(entry->data);
+		entry->data = NULL;
+		LOG("Seq num %lu processed.\n", c->expected_seq_num);
+		c->rq_present[(c->expected_seq_num & c->rq_mask) / 64] &= ~(1ULL << (c->expected_seq_num & 63));
+		c->expected_seq_num++;
+	}
+	if (c->rq_high < c->expected_seq_num) {
+		c->rq_high = c->expected_seq_num;
+	}
+}
+
+// Number of new packets that may be sent now: what the congestion window allows on top of the packets still in the network, and what the send queue has room for.
+// SACKed packets have left the network, so they don't count against the congestion window (the "pipe" of RFC 6675).
+int send_room(struct conn *c)
+{
+	int room = c->window - c->num_unacked;
+	int cc_room;
+
+	if (c->cc_algo != CC_NONE) {
+		cc_room = (c->cwnd < 1 ? 1 : (int)c->cwnd) - (c->num_unacked - c->sacked_out);
+		if (cc_room < room) {
+			room = cc_room;
+		}
+	}
+	return room;
+}
+
+// Duplicate acks that trigger a fast retransmit. With only a few packets in flight there can't be DUPACK_THRESHOLD of them, so wait for all the others instead (early retransmit, RFC 5827).
+static int dupack_threshold(struct conn *c)
+{
+	if (c->num_unacked > DUPACK_THRESHOLD) {
+		return DUPACK_THRESHOLD;
+	}
+	return c->num_unacked > 1 ? c->num_unacked - 1 : 1;
+}
+
+// Grow the congestion window for packets newly acked.
+void cwnd_acked(struct conn *c, int acked, long long now)
+{
+	double t, target, reno;
+
+	// Hold cwnd during fast recovery; after a timeout it slow starts from one packet as usual.
+	if (c->cc_algo == CC_NONE || c->in_recovery == RECOVERY_FAST) {
+		return;
+	}
+	if (c->cwnd < c->ssthresh) {
+		// Slow start: one more packet for each packet acked, up to ssthresh. (An ack that fills a gap acks many packets at once.)
+		c->cwnd += acked;
+		if (c->cwnd > c->ssthresh) {
+			c->cwnd = c->ssthresh;
+		}
+	} else if (c->cc_algo == CC_RENO) {
+		// Congestion avoidance: one more packet per round trip.
+		c->cwnd += (double)acked / c->cwnd;
+	} else {
+		if (c->cubic_epoch == 0) {
+			c->cubic_epoch = now;
+			if (c->cwnd < c->cubic_wmax) {
+				c->cubic_k = cbrt((c->cubic_wmax - c->cwnd) / CUBIC_C);
+			} else {
+				c->cubic_k = 0;
+				c->cubic_wmax = c->cwnd;
+			}
+		}
+		// Aim for where the cubic curve will be in a round trip: fast while far below the window of the last loss, flat around it, then probing beyond it.
+		t = (now - c->cubic_epoch + c->srtt) / 1e6;
+		target = CUBIC_C * (t - c->cubic_k) * (t - c->cubic_k) * (t - c->cubic_k) + c->cubic_wmax;
+		// Never grow slower than Reno would have (the "TCP friendly" region).
+		if (c->srtt > 0) {
+			reno = c->cubic_wmax * CUBIC_BETA + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (now - c->cubic_epoch) / c->srtt;
+			if (target < reno) {
+				target = reno;
+			}
+		}
+		if (target > c->cwnd) {
+			c->cwnd += (target - c->cwnd) / c->cwnd * acked;
+		} else {
+			c->cwnd += 0.01 * acked / c->cwnd;
+		}
+	}
+	// The send queue limits what is in flight beyond this, so growing further would only make losses take longer to show.
+	if (c->cwnd > c->window) {
+		c->cwnd = c->window;
+	}
+}
+
+// Shrink the congestion window after a loss: to ssthresh after a fast retransmit, to one packet after a timeout.
+void cwnd_loss(struct conn *c, int timeout)
+{
+	if (c->cc_algo == CC_NONE) {
+		return;
+	}
+	if (c->cc_algo == CC_CUBIC) {
+		// Fast convergence: if this loss came before cwnd got back to the last one, leave more room for other flows.
+		c->cubic_wmax = c->cwnd < c->cubic_wmax ? c->cwnd * (1 + CUBIC_BETA) / 2 : c->cwnd;
+		c->cubic_epoch = 0;
+	}
+	c->ssthresh = c->cwnd * (c->cc_algo == CC_CUBIC ? CUBIC_BETA : RENO_BETA);
+	if (c->ssthresh < 2) {
+		c->ssthresh = 2;
+	}
+	c->cwnd = timeout ? 1 : c->ssthresh;
+	LOG("Congestion window %.1f, ssthresh %.1f\n", c->cwnd, c->ssthresh);
+}
+
+// Start (or restart) the retransmission timer for the oldest packet in flight, or stop it if there is none.
+// As in TCP there is one timer for the whole send queue rather than one per packet.
+void set_retrans_timer(struct conn *c, long long now)
+{
+	long long timeout, pto;
+
+	c->retrans_probe = 0;
+	if (c->snd_una == c->next_seq_num) {
+		c->retrans_deadline = 0;
+		return;
+	}
+	// Back off exponentially: wait twice as long after each timeout, in case the path is congested.
+	// The count is the connection's, not the packet's, so a packet that was retransmitted in fast recovery doesn't start out backed off (RFC 6298 5.5, 5.7).
+	timeout = c->backoff < 20 ? c->rto << c->backoff : MAX_RTO;
+	if (timeout > MAX_RTO) {
+		timeout = MAX_RTO;
+	}
+	// If the last packets in flight, or the acks for them, are lost, no duplicate acks come to start a fast retransmit (or, in recovery, to show a retransmission was lost).
+	// So once the acks are overdue, probe rather than wait for the whole timeout (tail loss probe, RFC 8985). A lone packet may have its ack delayed.
+	// Allow for the RTT's variation too, or a busy host's jitter sets off probes for packets that weren't lost.
+	if (!c->probe_sent && c->backoff == 0 && c->srtt > 0) {
+		pto = 2 * c->srtt + 4 * c->rttvar + (c->num_unacked == 1 ? ACK_DELAY : 0);
+		if (pto < MIN_PTO) {
+			pto = MIN_PTO;
+		}
+		if (pto < timeout) {
+			timeout = pto;
+			c->retrans_probe = 1;
+		}
+	}
+	c->retrans_deadline = now + timeout;
+}
+
+// Send a packet from the send queue again.
+void retransmit_packet(struct conn *c, struct sq_entry *sn1, long long now)
+{
+	if (c->closed) {
+		return;
+	}
+	if (sn1->num_retrans >= MAX_RETRANS) {
+		//Connection timed out. Close the connection
+		conn_fail(c, "too many timeouts");
+		return;
+	}
+	//send_retransmission
+	LOG("Sending retransmission for seq_num. %lu\n", sn1->seq_num);
+	// The header is built again, so the retransmission carries our latest ack (and a binary header, if the other client has said it can parse one since).
+	send_entry(c, sn1, 0);
+	sn1->num_retrans++;
+	c->retrans_count++;
+	sn1->sent_us = now;
+	// The packets sent after the lost one are only acked once the retransmission fills the gap, so their times say nothing about the path.
+	c->rtt_seq = c->next_seq_num;
+}
+
+void check_retrans_timeout(struct conn *c)
+{
+	long long now;
+
+	if (c->retrans_deadline == 0 || c->closed) {
+		return;
+	}
+	now = now_us();
+	if (now < c->retrans_deadline) {
+		return;
+	}
+	if (c->retrans_probe) {
+		// Probe with the newest packet. Its ack acks everything if only acks were lost, or SACKs it, which starts a fast retransmit of what is missing.
+		// In recovery the newest may be SACKed already, so probe with the oldest hole instead.
+		LOG("Sending a tail loss probe.\n");
+		c->probe_sent = 1;
+		retransmit_packet(c, &c->sq_ring[(c->in_recovery ? c->snd_una : c->next_seq_num - 1) & c->sq_mask], now);
+		set_retrans_timer(c, now);
+		return;
+	}
+	//The oldest packet hasn't been acked within the retransmission timeout.
+	// Start again from one packet, unless an earlier timeout did already and nothing has got through since.
+	if (c->cwnd > 1) {
+		cwnd_loss(c, 1);
+	}
+	retransmit_packet(c, &c->sq_ring[c->snd_una & c->sq_mask], now);
+	c->backoff++;
+	set_retrans_timer(c, now);
+	// Everything in flight that hasn't been SACKed may be lost too. Retransmit it, a hole at a time, as acks come back (as RFC 6675 does after a timeout),
+	// rather than waiting for a timeout for each hole. No new recovery starts until everything sent so far is acked.
+	c->in_recovery = RECOVERY_RTO;
+	c->recover_seq = c->next_seq_num;
+	c->hole_seq = c->snd_una + 1;
+	c->dup_acks = 0;
+}
+
+// Retransmit the packets that the other client's SACK blocks show are missing, each once per recovery.
+// A hole retransmitted already is sent again if a packet sent after it has been acked or SACKed: the retransmission was lost too.
+void retransmit_holes(struct conn *c, long long now)
+{
+	struct sq_entry *sn1;
+	unsigned long seq;
+
+	if (c->hole_seq < c->snd_una) {
+		c->hole_seq = c->snd_una;
+	}
+	for (seq = c->snd_una; seq < c->hole_seq && seq < c->sack_high; seq++) {
+		sn1 = &c->sq_ring[seq & c->sq_mask];
+		// Allow a quarter of a round trip for packets that were only reordered.
+		if (!sn1->sacked && sn1->sent_us + c->srtt / 4 < c->sack_sent_us) {
+			LOG("Retransmission of seq num %lu was lost.\n", sn1->seq_num);
+			retransmit_packet(c, sn1, now);
+		}
+	}
+	while (c->hole_seq < c->sack_high) {
+		sn1 = &c->sq_ring[c->hole_seq & c->sq_mask];
+		if (!sn1->sacked) {
+			retransmit_packet(c, sn1, now);
+		}
+		c->hole_seq++;
+	}
+}
+
+// Mark the packets in the SACK blocks of an ack as received. Returns how many packets weren't marked before.
+int process_sack(struct conn *c, struct packet *p)
+{
+	unsigned long left, right, seq;
+	struct sq_entry *sn1;
+	int i, newly_sacked = 0;
+
+	for (i = 0; i < p->num_sack; i++) {
+		left = p->sack[i][0];
+		right = p->sack[i][1];
+		// Ignore blocks that are out of range, e.g. corrupted or for packets acked already.
+		if (left < c->snd_una) {
+			left = c->snd_una;
+		}
+		if (right > c->next_seq_num) {
+			right = c->next_seq_num;
+		}
+		for (seq = left; seq < right; seq++) {
+			sn1 = &c->sq_ring[seq & c->sq_mask];
+			if (!sn1->sacked) {
+				sn1->sacked = 1;
+				newly_sacked++;
+				c->sacked_out++;
+				if (sn1->sent_us > c->sack_sent_us) {
+					c->sack_sent_us = sn1->sent_us;
+				}
+			}
+		}
+		if (right > c->sack_high) {
+			c->sack_high = right;
+		}
+	}
+	return newly_sacked;
+}
+
+// Work out the SACK blocks for an ack: the runs of packets in the receive queue, up to MAX_SACK_BLOCKS of them.
+int sack_blocks(struct conn *c, unsigned long sack[][2])
+{
+	unsigned long seq = c->expected_seq_num;
+	int blocks = 0;
+
+	while (blocks < MAX_SACK_BLOCKS) {
+		sack[blocks][0] = rq_find(c, seq, c->rq_high, 1);
+		if (sack[blocks][0] == c->rq_high) {
+			break;
+		}
+		sack[blocks][1] = rq_find(c, sack[blocks][0], c->rq_high, 0);
+		seq = sack[blocks][1];
+		blocks++;
+	}
+	return blocks;
+}
+
+// Send a pure ack, with SACK blocks for the packets we have after the gap.
+void send_ack(struct conn *c, unsigned long ack)
+{
+	char rp[BIN_HEADER_SIZE + MAX_SACK_BLOCKS * 44 + 64];
+	unsigned long sack[MAX_SACK_BLOCKS][2];
+	int num_sack, len;
+
+	num_sack = sack_blocks(c, sack);
+	len = format_packet(c, rp, c->next_seq_num, ack, PKT_PURE_ACK | PKT_PIGGYBACK_OK | (c->use_binary ? PKT_BINARY_OK : 0), sack, num_sack, "\n", 1);
+	LOG("Sending pure ack %.*s", len, rp);
+	send_packet(c, rp, len);
+	// This covers any packets whose ack was being delayed.
+	c->ack_pending = 0;
+	c->ack_deadline = 0;
+}
+
+// Note a packet received in order, and ack it later: with the next one, with data going the other way, or after ACK_DELAY.
+void delay_ack(struct conn *c, long long now)
+{
+	c->ack_pending++;
+	if (c->ack_deadline == 0) {
+		c->ack_deadline = now + ACK_DELAY;
+	}
+}
+
+// We just sent data, which carries our ack. If the other client reads it there, no pure ack is needed.
+void piggybacked_ack(struct conn *c)
+{
+	if (c->piggyback_peer) {
+		c->ack_pending = 0;
+		c->ack_deadline = 0;
+	}
+}
+
+// Send the delayed ack if enough packets are waiting for it. Called after each batch of received packets, so one ack covers the whole batch.
+void flush_ack(struct conn *c)
+{
+	if (c->ack_pending >= ACK_EVERY) {
+		send_ack(c, c->expected_seq_num);
+	}
+}
+
+void check_ack_timeout(struct conn *c)
+{
+	if (c->ack_deadline != 0 && now_us() >= c->ack_deadline) {
+		send_ack(c, c->expected_seq_num);
+	}
+}
+
+// Write a number as n 6-bit digits.
+static void put_digits(char *p, unsigned long long v, int n)
+{
+	while (n-- > 0) {
+		p[n] = '0' + (v & ((1 << BIN_DIGIT_BITS) - 1));
+		v >>= BIN_DIGIT_BITS;
+	}
+}
+
+// Read a number written by put_digits(). Returns -1 if a digit is out of range, i.e. corrupted.
+static int get_digits(char *p, int n, unsigned long long *v)
+{
+	unsigned int d;
+
+	*v = 0;
+	while (n-- > 0) {
+		d = (unsigned char)*p++ - '0';
+		if (d >= 1 << BIN_DIGIT_BITS) {
+			return -1;
+		}
+		*v = (*v << BIN_DIGIT_BITS) | d;
+	}
+	return 0;
+}
+
+// Build a packet in buf: a binary header if the other client can parse it, else a text one, followed by the data.
+// Returns the length of the packet.
+int format_packet(struct conn *c, char *buf, unsigned long seq, unsigned long ack, int flags, unsigned long sack[][2], int num_sack, char *data, int data_len)
+{
+	int i, len;
+
+	if (!c->binary_peer) {
+		// "SEQ_NUM,ACK_NUM,FLAGS[,L-R...]:DATA"
+		len = sprintf(buf, "%lu,%lu,%d", seq, ack, flags);
+		for (i = 0; i < num_sack; i++) {
+			len += sprintf(buf + len, ",%lu-%lu", sack[i][0], sack[i][1]);
+		}
+		buf[len++] = ':';
+		memcpy(buf + len, data, data_len);
+		return len + data_len;
+	}
+	buf[0] = BIN_MAGIC;
+	put_digits(buf + BIN_LEN, data_len, 3);
+	put_digits(buf + BIN_SEQ, seq, 6);
+	put_digits(buf + BIN_ACK, ack, 6);
+	put_digits(buf + BIN_FLAGS, flags, 1);
+	put_digits(buf + BIN_NUM_SACK, num_sack, 1);
+	len = BIN_HEADER_SIZE;
+	for (i = 0; i < num_sack; i++) {
+		put_digits(buf + len, sack[i][0], 6);
+		put_digits(buf + len + 6, sack[i][1], 6);
+		len += BIN_SACK_SIZE;
+	}
+	memcpy(buf + len, data, data_len);
+	len += data_len;
+	put_digits(buf + BIN_CRC, crc32c(0, buf + BIN_LEN, len - BIN_LEN), 6);
+	return len;
+}
+
+// Parse a packet with a text header. Returns -1 if it is corrupted.
+int parse_text_packet(char *packet, int pkt_size, struct packet *p)
+{
+	char *s = packet, *end;
+
+	p->seq_num = strtoul(s, &end, 10);
+	if (end == s || *end != ',') {
+		return -1;
+	}
+	s = end + 1;
+	p->ack_num = strtoul(s, &end, 10);
+	if (end == s || *end != ',') {
+		return -1;
+	}
+	s = end + 1;
+	p->flags = strtoul(s, &end, 10);
+	if (end == s) {
+		return -1;
+	}
+	// Pure acks can have SACK blocks, ",L-R" each.
+	p->num_sack = 0;
+	while (*end == ',' && p->num_sack < MAX_SACK_BLOCKS) {
+		s = end + 1;
+		p->sack[p->num_sack][0] = strtoul(s, &end, 10);
+		if (end == s || *end != '-') {
+			return -1;
+		}
+		s = end + 1;
+		p->sack[p->num_sack][1] = strtoul(s, &end, 10);
+		if (end == s) {
+			return -1;
+		}
+		p->num_sack++;
+	}
+	if (*end != ':') {
+		return -1;
+	}
+	p->data = end + 1;
+	p->data_len = pkt_size - (p->data - packet);
+	return 0;
+}
+
+// Parse a packet with a binary header. Returns -1 if it is corrupted: the checksum or the length is wrong.
+int parse_binary_packet(char *packet, int pkt_size, struct packet *p)
+{
+	unsigned long long crc, len, seq, ack, flags, num_sack, left, right;
+	int i, header_size;
+
+	if (pkt_size < BIN_HEADER_SIZE ||
+	    get_digits(packet + BIN_CRC, 6, &crc) < 0 ||
+	    get_digits(packet + BIN_LEN, 3, &len) < 0 ||
+	    get_digits(packet + BIN_SEQ, 6, &seq) < 0 ||
+	    get_digits(packet + BIN_ACK, 6, &ack) < 0 ||
+	    get_digits(packet + BIN_FLAGS, 1, &flags) < 0 ||
+	    get_digits(packet + BIN_NUM_SACK, 1, &num_sack) < 0 ||
+	    num_sack > MAX_SACK_BLOCKS) {
+		return -1;
+	}
+	header_size = BIN_HEADER_SIZE + num_sack * BIN_SACK_SIZE;
+	if (pkt_size != header_size + (int)len || crc != crc32c(0, packet + BIN_LEN, pkt_size - BIN_LEN)) {
+		return -1;
+	}
+	for (i = 0; i < (int)num_sack; i++) {
+		get_digits(packet + BIN_HEADER_SIZE + i * BIN_SACK_SIZE, 6, &left);
+		get_digits(packet + BIN_HEADER_SIZE + i * BIN_SACK_SIZE + 6, 6, &right);
+		p->sack[i][0] = left;
+		p->sack[i][1] = right;
+	}
+	p->seq_num = seq;
+	p->ack_num = ack;
+	p->flags = flags;
+	p->num_sack = num_sack;
+	p->data = packet + header_size;
+	p->data_len = len;
+	return 0;
+}
+
+// When the next retransmission or delayed ack is due, or 0 if neither is waiting.
+long long next_deadline(struct conn *c)
+{
+	long long deadline;
+
+	deadline = c->retrans_deadline;
+	if (c->ack_deadline != 0 && (deadline == 0 || c->ack_deadline < deadline)) {
+		deadline = c->ack_deadline;
+	}
+	return deadline;
+}
+
+// Send a whole packet, as a partial send would corrupt the stream. If the socket buffer is full, a blocking socket waits for room;
+// a non-blocking one keeps the rest of the packet in out_buf, and the packets after it follow it there until conn_flush() has sent it.
+void send_packet(struct conn *c, char *pkt, int len)
+{
+	int n;
+
+	if (c->out_len > 0) {
+		// Dropping a whole packet is safe: the protocol recovers from it like from any other loss.
+		if (out_queue(c, pkt, len) < 0) {
+			LOG("Too much waiting for the socket, dropping a packet.\n");
+		}
+		return;
+	}
+	while (len > 0 && !c->closed) {
+		// A connection the relay has closed fails here rather than killing the process with SIGPIPE.
+		n = send(c->sockfd, pkt, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (c->nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				// Part of the packet may have gone already, so the rest must be kept.
+				if (out_queue(c, pkt, len) < 0) {
+					conn_fail(c, "out of memory for the output queue");
+				}
+				return;
+			}
+			conn_fail(c, strerror(errno));
+			return;
+		}
+		pkt += n;
+		len -= n;
+	}
+}
+
+// Make room for len more bytes of data at the head of the send buffer, in one piece. Returns the offset of the room, or 0 if there is no memory for it.
+// Data never wraps around the end of the buffer: if it doesn't fit before the end, the bytes there are skipped.
+static unsigned long sq_alloc(struct conn *c, int len)
+{
+	unsigned long head, size, seq, old_mask, new_mask;
+	char *buf;
+	struct sq_entry *entry;
+
+	while (1) {
+		head = c->sq_head;
+		if ((head & (c->sq_buf_size - 1)) + len > c->sq_buf_size) {
+			head += c->sq_buf_size - (head & (c->sq_buf_size - 1));
+		}
+		if (head + len - c->sq_tail <= c->sq_buf_size) {
+			c->sq_head = head + len;
+			return head;
+		}
+		// Full: double the buffer. Each packet's data stays in one piece at its offset under the new size.
+		size = c->sq_buf_size * 2;
+		buf = malloc(size);
+		if (!buf) {
+			return 0;
+		}
+		old_mask = c->sq_buf_size - 1;
+		new_mask = size - 1;
+		for (seq = c->snd_una; seq < c->next_seq_num; seq++) {
+			entry = &c->sq_ring[seq & c->sq_mask];
+			memcpy(buf + (entry->off & new_mask), c->sq_buf + (entry->off & old_mask), entry->len);
+		}
+		free(c->sq_buf);
+		c->sq_buf = buf;
+		c->sq_buf_size = size;
+	}
+}
+
+// Build a packet from a send queue entry, with our latest ack, and send it.
+void send_entry(struct conn *c, struct sq_entry *entry, int flags)
+{
+	char rp[MAXPACKET];
+	int len;
+
+	//Add sequence number and ack to the packet. Since we have data in this packet, pure ack is not set.
+	len = format_packet(c, rp, entry->seq_num, c->expected_seq_num, flags, NULL, 0, c->sq_buf + (entry->off & (c->sq_buf_size - 1)), entry->len);
+	send_packet(c, rp, len);
+	piggybacked_ack(c);
+}
+
+struct sq_entry *add_to_send_queue(struct conn *c, char *payload, int pl_size)
+{
+	struct sq_entry *entry;
+	unsigned long off;
+
+	//Add the packet to send queue. This will be useful in sending retranmission.
+	off = sq_alloc(c, pl_size);
+	if (off == 0) {
+		return NULL;
+	}
+	memcpy(c->sq_buf + (off & (c->sq_buf_size - 1)), payload, pl_size);
+	entry = &c->sq_ring[c->next_seq_num & c->sq_mask];
+	entry->off = off;
+	entry->len = pl_size;
+	entry->seq_num = c->next_seq_num;
+	entry->sent_us = now_us();
+	entry->num_retrans = 0;
+	entry->sacked = 0;
+
+	c->num_unacked++;
+	
+	//Increase the sequence number for the next packet.
+	c->next_seq_num++;
+	// Start the timer if nothing else was in flight. A tail loss probe is due a while after the newest packet, so it moves on with every packet sent.
+	if (c->retrans_deadline == 0 || c->retrans_probe) {
+		set_retrans_timer(c, entry->sent_us);
+	}
+
+	return entry;
+}
+
+// Process the ack number (and SACK blocks) of a packet. Pure acks and data packets both carry one.
+void process_ack(struct conn *c, struct packet *p)
+{
+	struct sq_entry *sn1;
+	unsigned long ack = p->ack_num;
+	int newly_sacked;
+	long long rtt = 0;
+
+	if (p->flags & PKT_PURE_ACK) {
+		LOG("Pure ack is received: %lu\n", ack);
+	}
+	//Remove the acked packets from the send queue.
+	if (ack < c->snd_una || ack > c->next_seq_num) {
+		// An old ack that arrived late (or a corrupted ack number).
+		return;
+	}
+	newly_sacked = process_sack(c, p);
+	if (ack == c->snd_una) {
+		if (!(p->flags & PKT_PURE_ACK)) {
+			// Every data packet carries an ack, so one that doesn't ack anything new says nothing about loss.
+			return;
+		}
+		// A duplicate ack: the other client got a packet, but is still missing this one.
+		// Only count it if it SACKs something new, as the relay can also duplicate packets, and their acks say nothing about loss.
+		// After a tail loss probe one is enough: the probe was sent last, so what is still missing was lost (as RACK, RFC 8985, would conclude).
+		if (newly_sacked > 0 && c->snd_una != c->next_seq_num && (++c->dup_acks >= dupack_threshold(c) || c->probe_sent) && !c->in_recovery) {
+			// Fast retransmit: don't wait for the timeout, the packet is most likely lost.
+			LOG("Fast retransmit after %d duplicate acks.\n", c->dup_acks);
+			cwnd_loss(c, 0);
+			c->in_recovery = RECOVERY_FAST;
+			c->recover_seq = c->next_seq_num;
+			retransmit_packet(c, &c->sq_ring[c->snd_una & c->sq_mask], now_us());
+			c->hole_seq = c->snd_una + 1;
+		}
+		if (c->in_recovery) {
+			retransmit_holes(c, now_us());
+		}
+		return;
+	}
+	c->dup_acks = 0;
+	// Something got through, so the path works: go back to the unbacked-off timeout, and allow another probe.
+	c->backoff = 0;
+	c->probe_sent = 0;
+	cwnd_acked(c, ack - c->snd_una, now_us());
+	//Remove all the packets which have sequence number lower than the ack.
+	while (c->snd_una < ack) {
+		sn1 = &c->sq_ring[c->snd_una & c->sq_mask];
+		LOG("Ack num %lu removed.\n", sn1->seq_num);
+		// Karn's rule: an ack for a retransmitted packet could be for any of its copies, so only time packets sent once, after any retransmission.
+		if (sn1->num_retrans == 0 && sn1->seq_num >= c->rtt_seq) {
+			rtt = now_us() - sn1->sent_us;
+		}
+		if (sn1->sacked) {
+			c->sacked_out--;
+		} else if (sn1->sent_us > c->sack_sent_us) {
+			c->sack_sent_us = sn1->sent_us;
+		}
+		c->num_unacked--;
+		c->snd_una++;
+	}
+	// Their data can be overwritten now.
+	c->sq_tail = c->snd_una == c->next_seq_num ? c->sq_head : c->sq_ring[c->snd_una & c->sq_mask].off;
+	if (rtt > 0) {
+		rtt_sample(c, rtt);
+		LOG("RTT %lld us, SRTT %lld us, RTTVAR %lld us, RTO %lld us\n", rtt, c->srtt, c->rttvar, c->rto);
+	}
+	if (c->sack_high < c->snd_una) {
+		c->sack_high = c->snd_una;
+	}
+	// Time the new oldest packet from now.
+	set_retrans_timer(c, now_us());
+	if (c->in_recovery) {
+		if (c->snd_una >= c->recover_seq) {
+			c->in_recovery = 0;
+		} else {
+			// Everything up to another hole was acked. Retransmit it (and any others found since) right away.
+			if (c->hole_seq <= c->snd_una) {
+				retransmit_packet(c, &c->sq_ring[c->snd_una & c->sq_mask], now_us());
+				c->hole_seq = c->snd_una + 1;
+			}
+			retransmit_holes(c, now_us());
+		}
+	}
+}
+
+int process_recv_packet(struct conn *c, char *packet, int pkt_size)
+{
+	struct packet p;
+	int had_gap;
+
+	// Parse the header. A binary header starts with BIN_MAGIC, a text header with the sequence number.
+	if ((packet[0] == BIN_MAGIC ? parse_binary_packet(packet, pkt_size, &p) : parse_text_packet(packet, pkt_size, &p)) < 0) {
+		// The header is corrupted (or, for a binary header, the checksum doesn't match), drop the packet.
+		LOG("Dropping corrupted packet.\n");
+		return 0;
+	}
+	if (c->use_binary && !c->binary_peer && (p.flags & PKT_BINARY_OK)) {
+		LOG("The other client can parse binary headers, using them from now on.\n");
+		c->binary_peer = 1;
+	}
+	if (!c->piggyback_peer && (p.flags & PKT_PIGGYBACK_OK)) {
+		LOG("The other client reads acks on data packets.\n");
+		c->piggyback_peer = 1;
+	}
+	// The ack comes first: on a data packet it is piggybacked, so the other client didn't need to send a pure ack.
+	process_ack(c, &p);
+	if (p.flags & PKT_PURE_ACK) {
+		return 0;
+	}
+
+	//Check if we received a packet out of order. If the sequence number on the packet is greater than the expected sequenece number then we have received it out of order.
+	if (p.seq_num > c->expected_seq_num) {
+		//If the packet is out of order then add it to the receive queue, in the slot for its sequence number.
+		if (rq_add(c, p.seq_num, p.data, p.data_len)) {
+			LOG("Adding seqnum %lu\n", p.seq_num);
+		}
+		LOG("Expected seq num was: %lu\n", c->expected_seq_num);
+		// Send a duplicate ack, so the other client learns about the gap (from the SACK blocks) without waiting for a timeout.
+		send_ack(c, c->expected_seq_num);
+	} else if (p.seq_num < c->expected_seq_num) {
+		// A duplicate of a packet we already had. Our ack for it may have been lost, so ack again right away.
+		LOG("Seq num %lu is a duplicate.\n", p.seq_num);
+		c->dup_count++;
+		send_ack(c, c->expected_seq_num);
+	} else {
+		//Recieved a packet in correct order. Send the data to the user.
+		c->deliver(c, p.data, p.data_len);
+		//Increase the next expected sequence number.
+		c->expected_seq_num++;
+
+		LOG("Seq num %lu processed.\n", p.seq_num);
+		LOG("Ack num %lu processed.\n", p.ack_num);
+
+		had_gap = c->rq_high > c->expected_seq_num;
+		// Check if we need to process any packets that are already present in the receive queue.
+		rq_drain(c);
+
+		LOG("Next expected seq num: %lu\n", c->expected_seq_num);
+		if (had_gap) {
+			// The packet filled (part of) a gap. Ack it and the buffered packets after it at once, with one cumulative ack: the other client is recovering from the loss.
+			send_ack(c, c->expected_seq_num);
+		} else if (p.flags & PKT_ACK_NOW) {
+			// The other client can't send more until it gets this ack.
+			send_ack(c, c->expected_seq_num);
+		} else {
+			// Don't send a pure ack for every packet, one can cover the next packet too.
+			delay_ack(c, now_us());
+		}
+	}
+	return 0;
+}
+
+// Length of the packet at the start of buf, which holds len bytes: 0 if it is incomplete, -1 if no packet can be that long.
+// A binary header says how long the packet is, so its end is checked directly. Otherwise (or if it doesn't end there, e.g. because the relay corrupted it) the packet ends at the first newline.
+// A binary packet that was cut short has lost its newline, though, and would take the next packet with it up to that one's newline.
+// Header digits are never BIN_MAGIC, so if one turns up before the newline, end the bad packet there instead. A payload byte that happens
+// to be BIN_MAGIC only splits a packet that is bad already; the CRC rejects both parts.
+int frame_length(char *buf, int len)
+{
+	unsigned long long data_len, num_sack;
+	char *nl, *magic;
+	int size, end;
+
+	if (buf[0] == BIN_MAGIC && len >= BIN_HEADER_SIZE &&
+	    get_digits(buf + BIN_LEN, 3, &data_len) == 0 &&
+	    get_digits(buf + BIN_NUM_SACK, 1, &num_sack) == 0) {
+		size = BIN_HEADER_SIZE + num_sack * BIN_SACK_SIZE + data_len;
+		if (size <= len && size <= MAXPACKET && buf[size-1] == '\n') {
+			return size;
+		}
+	}
+	nl = memchr(buf, '\n', len < MAXPACKET ? len : MAXPACKET);
+	if (nl == NULL && len < MAXPACKET) {
+		return 0;
+	}
+	end = nl != NULL ? nl - buf + 1 : MAXPACKET;
+	if (buf[0] == BIN_MAGIC && (magic = memchr(buf + 1, BIN_MAGIC, end - 1)) != NULL) {
+		return magic - buf;
+	}
+	return nl != NULL ? end : -1;
+}
+
+// Process every whole packet in recv_buf, and keep what is left of a partial one for the next recv.
+void process_recv_buf(struct conn *c)
+{
+	char *packet, saved;
+	char *nl;
+	int used = 0, len;
+
+	if (c->recv_skipping) {
+		nl = memchr(c->recv_buf, '\n', c->recv_len);
+		used = nl != NULL ? nl - c->recv_buf + 1 : c->recv_len;
+		c->recv_skipping = nl == NULL;
+	}
+	while (used < c->recv_len && !c->closed) {
+		packet = c->recv_buf + used;
+		len = frame_length(packet, c->recv_len - used);
+		if (len == 0) {
+			break;
+		}
+		if (len < 0) {
+			// No newline where a packet must have ended: it was mangled on the way. Drop the line, the packet will be retransmitted.
+			LOG("Dropping a line too long to be a packet.\n");
+			used = c->recv_len;
+			c->recv_skipping = 1;
+			break;
+		}
+		used += len;
+		// Process the packet where it is. The byte after it is the start of the next one, so put it back afterwards.
+		saved = packet[len];
+		packet[len] = '\0';
+		process_recv_packet(c, packet, len);
+		packet[len] = saved;
+	}
+	memmove(c->recv_buf, c->recv_buf + used, c->recv_len - used);
+	c->recv_len -= used;
+}
@@ -1,31 +1,119 @@
 /* A relay server which takes message from one client and relays it to other.
  * Before relaying the messages the server can drop or corrupt the messages randomly.
+ * Any number of clients may connect; they are paired into relay sessions in the order
+ * they arrive, and all sessions are served from a single edge-triggered epoll loop
+ * (or, with -U, from a single io_uring completion loop).  With -t n, n worker threads
+ * each run their own loop on their own SO_REUSEPORT welcome socket, and each session
+ * belongs to the worker that accepted its second client.
  */
+#define _GNU_SOURCE // for accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <netinet/tcp.h>
  
 #include "urs-util.h"
+#include "urs-uring.h"
+#include "urs-metrics.h"
 
-#define BUFSIZE 128
-#define OUT stderr
+#define READSIZE 65536   // default size of each connection's input buffer (-b)
+#define MAXLINE 65536    // default longest message accepted, including newline (-L)
+#define MAXEVENTS 64 // epoll_wait() batch size
+#define IOVBATCH 64  // most messages gathered into one writev()
+#define READBUDGET 16 // most read()s from one connection per wakeup, for fairness
+
+/* Per-connection state. Each relay session owns two of these, one per client,
+   in place of the old global [2] arrays which only allowed a single pair. */
+struct conn{
+  int fd;                   // socket, or -1 once closed
+  int channel;              // 0 or 1: position within the session (for log arrows)
+  struct chunk *in;         // input chunk that read()s land in, or 0 while idle
+  int head;                 // start of the first unprocessed (partial) message in 'in'
+  int scan;                 // in->data[head..scan) is known to contain no newline
+  int tail;                 // end of data read into 'in'
+  int discarding;           // non-zero while skipping the rest of an overlong message
+  struct session_dir *stats; // counts of messages (and bytes) from this client, and the impairments applied to them
+  struct mq *msq;           // message send queue for output to this client
+  struct msg *out;          // ring of due messages not yet (fully) written to this client
+  int out_first;            // index of oldest message in 'out'
+  int out_count;            // number of messages in 'out'
+  int out_size;             // allocated size of 'out'
+  int out_offset;           // bytes of the oldest message already written
+  int blocked;              // non-zero while the socket buffer is full (waiting for EPOLLOUT)
+  int throttled;            // non-zero if reading stopped because the peer is blocked
+  int ready;                // non-zero while on the ready list (read budget used up)
+  struct conn *next_ready;  // ready list
+  int ops;                  // io_uring requests in flight that refer to this connection
+  int recv_armed;           // 1 while a multishot recv() is armed, 2 once it is being cancelled
+  int sends;                // io_uring sends in flight
+  struct uring_send *us;    // io_uring send descriptors, allocated on first use
+  long long client_start;   // time of first incoming message from this client
+  long long client_latest;  // time of most recent incoming message from this client
+  struct rng rng;           // impairment decisions for messages from this client
+  struct session *session;  // the session this connection belongs to
+  struct conn *peer;        // the other end of the session
+};
+
+/* A relay session: two clients paired in the order they connected. Sessions with
+   messages in their send queues are kept on the 'busy' list, so that each loop only
+   has to look at sessions with work to do when computing timeouts and sending. */
+struct session{
+  int id;
+  struct conn conn[2];
+  struct session_slot *slot; // its slot in the metrics session table, where its counters are, or 0
+  struct session_dir stats[2]; // its counters while it has no slot (the table was full, or it has closed)
+  int busy;                 // non-zero while on the busy list
+  struct session *next;     // busy list (or dead list, once closed)
+  struct session *prev;
+};
 
 /* internal function headers */
-int enqueue_message(int q);
-int send_message(int sq);
-void randomly_corrupt(char *msg);
-void corrupt_character_flip(char *msg);
-void corrupt_insert_newline(char *msg);
-void corrupt_truncate_clean(char *msg);
-void corrupt_truncate_clean(char *msg);
-void corrupt_truncate_dirty(char *msg);
+void accept_clients(int welcomesockfd);
+struct session *make_session(int fd0, int fd1);
+void close_session(struct session *s);
+void mark_busy(struct session *s);
+int next_timeout_milli();
+int open_welcome_socket(int port);
+void *worker(void *arg);
+void epoll_loop(int welcomesockfd);
+void flush_busy();
+void reap_sessions();
+void add_client(int fd);
+int read_client(struct conn *c);
+int received(struct conn *c, int n);
+void release_idle(struct conn *c);
+void make_room(struct conn *c);
+int enqueue_message(struct conn *c);
+void out_push(struct conn *c, struct msg *m);
+int flush_conn(struct conn *c);
+void out_written(struct conn *c, int n);
+int flush_session(struct session *s);
+int randomly_corrupt(struct msg *m, struct rng *r);
+void corrupt_character_flip(struct msg *m, struct rng *r);
+void corrupt_insert_newline(struct msg *m, struct rng *r);
+void corrupt_truncate_clean(struct msg *m, struct rng *r);
+void corrupt_truncate_dirty(struct msg *m, struct rng *r);
+#ifdef URS_HAVE_URING
+void uring_loop(int welcomesockfd);
+void uring_arm_accept(int welcomesockfd);
+void uring_arm_recv(struct conn *c);
+void uring_cancel_recv(struct conn *c);
+int uring_received(struct conn *c, char *data, int len);
+int uring_send(struct conn *c);
+#endif
 
 /* option flags set from cmd-line option args */
 int flag_verbose = 0;
@@ -36,26 +124,41 @@ int flag_latency = 0;
 int flag_reorder_rate = 0;
 int flag_reorder_step = 0; // default 0 => randomised
 int flag_duplicate_rate = 0;
+int flag_read_size = READSIZE;
+int flag_max_line = MAXLINE;
+int flag_uring = 0;
+int flag_threads = 1;
+unsigned long long flag_seed = 1;
+char *flag_metrics = 0;
 
-int sessionsockfd[2];    // sockets
-char buffer[2][BUFSIZE]; // read buffers for each socket
-int buf_insert[2];       // insertion indexes for each read buffer
-int msgcount[2];         // message counters for each input channel
-struct mq* msq[2];       // message send queues for each output channel
-int client_bytes[2];     // counts of incoming bytes from each client
-long long client_start[2];  // time of first incoming message from each client
-long long client_latest[2]; // time of most recent incoming message from each client
+/* shared by all worker threads; only touched when clients arrive or leave */
+int *welcome_fds;              // one welcome socket per worker
+pthread_mutex_t lobby_lock = PTHREAD_MUTEX_INITIALIZER;
+int waiting_fd = -1;           // accept()ed client still waiting for a partner, or -1 (lobby_lock)
+int waiting_uring = 0;         // non-zero if waiting_fd was accept()ed as a blocking socket (lobby_lock)
+int session_ids = 0;           // source of session ids (atomic)
+int session_count = 0;         // number of live sessions, over all workers (atomic)
+struct metrics_shm *metrics_shm; // a metrics slot per worker, and the live session table
+
+/* each worker thread's own state, so that the relaying itself needs no locks */
+__thread int uring_active = 0;          // non-zero if this worker runs the io_uring engine
+__thread int worker_id;                 // this worker's number
+__thread struct metrics *metrics;       // this worker's metrics slot
+__thread int epfd = -1;                 // epoll instance watching the welcome socket and all clients
+__thread struct session *busy_head = 0; // sessions with queued messages
+__thread struct session *dead_head = 0; // sessions closed during the current batch of events
+__thread struct conn *ready_head = 0;   // connections with input left over from an earlier wakeup
 
 int main(int argc, char *argv[]) {
-  int welcomesockfd, port;
-  socklen_t clilen;
-  struct sockaddr_in serv_addr, cli_addr[2];
-  int n,c;
-  struct pollfd poll_array[2];
+  int port;
+  int c, i;
 
   /* process command-line arguments */
-  while ((c = getopt(argc, argv, "c:C:dl:r:R:vx:h")) != -1){
+  while ((c = getopt(argc, argv, "b:c:C:dl:L:M:r:R:s:t:Uvx:h")) != -1){
     switch(c){
+      case 'b':
+        flag_read_size = atoi(optarg);
+        break;
       case 'c':
         flag_corrupt_rate = atoi(optarg);
 	break;
@@ -68,12 +171,27 @@ int main(int argc, char *argv[]) {
       case 'l':
         flag_latency = atoi(optarg);
 	break;
+      case 'L':
+        flag_max_line = atoi(optarg);
+        break;
+      case 'M':
+        flag_metrics = optarg;
+        break;
       case 'r':
         flag_reorder_rate = atoi(optarg);
         break;
       case 'R':
         flag_reorder_step = atoi(optarg);
         break;
+      case 's':
+        flag_seed = strtoull(optarg, 0, 0);
+        break;
+      case 't':
+        flag_threads = atoi(optarg);
+        break;
+      case 'U':
+        flag_uring++;
+        break;
       case 'v':
         flag_verbose++;
         break;
@@ -82,17 +200,25 @@ int main(int argc, char *argv[]) {
 	break;
       case 'h':
         fprintf(stderr,"Usage: %s [options] port\n", argv[0]);
+        fprintf(stderr,"Clients are paired into relay sessions in the order they connect.\n");
         fprintf(stderr,"Currently supported options:\n");
+        fprintf(stderr," -b n  Read client input in buffers of n bytes (default %d).\n", READSIZE);
         fprintf(stderr," -c p  Randomly corrupt about p%% of messages.\n");
         fprintf(stderr," -C t  corruption type: 1=char-flip; 2=insert-newline; 3=truncate; ...\n");
         fprintf(stderr," -d    Randomly drop about 10%% of messages.\n");
         fprintf(stderr," -dd   Randomly drop about 25%% of messages.\n");
         fprintf(stderr," -ddd  Randomly drop about 50%% of messages.\n");
         fprintf(stderr," -l m  Add at least m milliseconds latency to each message.\n");
+        fprintf(stderr," -L n  Discard messages longer than n bytes (default %d).\n", MAXLINE);
+        fprintf(stderr," -M nm Publish metrics in shared memory segment nm (read them with urs-stat nm).\n");
         fprintf(stderr," -r p  Reorder about p%% of messages according to -R setting.\n");
         fprintf(stderr," -R p  Reorder by up to p queue places (>0:earlier; <0:later; 0:random +/-5).\n");
         fprintf(stderr,"       Out-of-order delivery works best with some -l latency.\n");
-        fprintf(stderr," -v    Verbose output of debug messages. More -vs may increase verbosity.\n");
+        fprintf(stderr," -s n  Seed for the random impairments (default 1); each session's are reproducible.\n");
+        fprintf(stderr," -t n  Relay with n worker threads, each accept()ing on its own SO_REUSEPORT socket.\n");
+        fprintf(stderr," -U    Use the io_uring engine instead of epoll (falls back to epoll if unavailable).\n");
+        fprintf(stderr," -v    Log every message relayed, dropped, corrupted etc. (-vv: also input buffer\n");
+        fprintf(stderr,"       contents; -vvv: also queue contents and timeouts).\n");
         fprintf(stderr," -x p  Randomly duplicate about p%% of messages (including duplicates).\n");
         fprintf(stderr," -h    Print this help message.\n");
         exit(1);
@@ -113,177 +239,600 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
   port = atoi(argv[optind]);
-  fprintf(stderr,"Unreliable Relay Server v06\n");
+  if (flag_read_size < 64 || flag_max_line < 1 || flag_threads < 1){
+    fprintf(stderr,"-b must be at least 64, -L at least 1 and -t at least 1\n");
+    exit(1);
+  }
+  fprintf(stderr,"Unreliable Relay Server v07\n");
   fprintf(stderr,"now64:%lld\n",now64());
   if (flag_verbose > 1) fprintf(stderr,"now64:%lld\n",now64()/1000000);
+  log_level = flag_verbose;
   fprintf(stderr,"flag_verbose:%d flag_drop:%d\n",flag_verbose,flag_drop);
   fprintf(stderr,"flag_reorder_rate:%d flag_reorder_step:%d\n", flag_reorder_rate, flag_reorder_step);
   fprintf(stderr,"flag_corrupt_rate:%d flag_corrupt_type:%d\n", flag_corrupt_rate, flag_corrupt_type);
   fprintf(stderr,"flag_latency:%d flag_duplicate_rate:%d\n", flag_latency, flag_duplicate_rate);
+  fprintf(stderr,"flag_read_size:%d flag_max_line:%d\n", flag_read_size, flag_max_line);
+  fprintf(stderr,"flag_uring:%d flag_threads:%d flag_seed:%llu\n", flag_uring, flag_threads, flag_seed);
+  fprintf(stderr,"flag_metrics:%s\n", flag_metrics ? flag_metrics : "(none)");
+
+  /* a client that goes away mid-write must only end its own session, not the relay */
+  signal(SIGPIPE, SIG_IGN);
+
+  // set up server sockets, all listening before any worker starts
+  welcome_fds = (int*)malloc(flag_threads * sizeof(int));
+  if (!welcome_fds) error("ERROR: malloc() failed in main()\n");
+  for(i = 0; i < flag_threads; i++){
+    welcome_fds[i] = open_welcome_socket(port);
+  }
+  fprintf(stderr, "listen()ing for client connections on server port %d\n", port);
+  metrics_shm = metrics_open(flag_metrics, flag_threads);
 
-  // set up server socket
-  welcomesockfd = socket(AF_INET, SOCK_STREAM, 0);
+  /* the main thread is worker 0 */
+  for(i = 1; i < flag_threads; i++){
+    pthread_t thread;
+    int err = pthread_create(&thread, 0, worker, (void*)(long)i);
+    if (err){
+      errno = err;
+      error("ERROR starting worker thread");
+    }
+  }
+  worker((void*)0);
+
+  // do we even ever get here?
+  fprintf(stderr, "closing sockets\n");
+  for(i = 0; i < flag_threads; i++){
+    close(welcome_fds[i]);
+  }
+  return 0; 
+}
+
+/* create a non-blocking listening socket; with several workers, each has its own
+   and the kernel spreads incoming connections across them */
+int open_welcome_socket(int port)
+{
+  struct sockaddr_in serv_addr;
+  int welcomesockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (welcomesockfd < 0){
     error("ERROR opening welcome socket");
   }
+  if (flag_threads > 1){
+    int on = 1;
+    if (setsockopt(welcomesockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      error("ERROR setting SO_REUSEPORT on welcome socket");
+  }
   memset((char *) &serv_addr,'\0',sizeof(serv_addr));
   serv_addr.sin_family = AF_INET;
   serv_addr.sin_addr.s_addr = INADDR_ANY;
   serv_addr.sin_port = htons(port);
   if (bind(welcomesockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) 
     error("ERROR on bind()ing welcome socket");
-  listen(welcomesockfd,5);
-  fprintf(stderr, "listen()ing for client connections on server port %d\n", port);
+  listen(welcomesockfd,SOMAXCONN);
+  return welcomesockfd;
+}
+
+/* run one worker's engine on its welcome socket; never returns */
+void *worker(void *arg)
+{
+  int id = (int)(long)arg;
+  int welcomesockfd = welcome_fds[id];
+  worker_id = id;
+  metrics = &metrics_shm->worker[id];
+  if (flag_uring){
+#ifdef URS_HAVE_URING
+    uring_loop(welcomesockfd); // only returns if io_uring can't be set up
+#else
+    fprintf(stderr, "io_uring support was not compiled in\n");
+#endif
+    fprintf(stderr, "worker %d falling back to epoll\n", id);
+  }
+  epoll_loop(welcomesockfd);
+  return 0;
+}
+
+/*
+ * The epoll engine (default).
+ * One epoll instance watches the welcome socket and every client socket.
+ * Everything is edge-triggered, so each readiness event must be drained
+ * until the socket reports EAGAIN. The welcome socket is tagged with a
+ * null data pointer; client sockets carry a pointer to their struct conn.
+ */
+void epoll_loop(int welcomesockfd)
+{
+  struct epoll_event ev, events[MAXEVENTS];
+  epfd = epoll_create1(0);
+  if (epfd < 0) error("ERROR on epoll_create1()");
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = 0;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, welcomesockfd, &ev) < 0)
+    error("ERROR adding welcome socket to epoll set");
+
+  /* loop forever, reading input from any client socket and re-writing to its peer */
+  while(1){
+    /* epoll_wait() must wait for a finite time only, because there may be queued
+       messages whose time-to-send has arrived. Each queue can tell us when its next
+       message is due, so the timeout is the earliest of those across all busy
+       sessions (see next_timeout_milli()). If nothing is queued anywhere, we block
+       until input arrives. */
+    int timeout = ready_head ? 0 : next_timeout_milli();
+    LOG(LOG_DEBUG, "DEBUG: next_timeout_milli(): %d\n", timeout);
+    /* the end of a batch of work: write out what it logged before going to sleep */
+    log_flush();
+    int nev = epoll_wait(epfd, events, MAXEVENTS, timeout);
+    if (nev < 0){
+      if (errno == EINTR) continue;
+      error("ERROR on epoll_wait()");
+    }
+
+    int e = 0;
+    for(e = 0; e < nev; e++){
+      struct conn *cn = (struct conn *)events[e].data.ptr;
+      if (!cn){
+        accept_clients(welcomesockfd);
+        continue;
+      }
+      if (cn->fd < 0){
+        /* session was closed by an earlier event in this batch */
+        continue;
+      }
+      if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        if (!read_client(cn)){
+          close_session(cn->session);
+          continue;
+        }
+      }
+      if ((events[e].events & EPOLLOUT) && cn->blocked){
+        /* socket buffer has drained: finish the interrupted output, then resume
+           reading from the peer if we had stopped because of this connection */
+        if (!flush_conn(cn)){
+          close_session(cn->session);
+          continue;
+        }
+        if (!cn->blocked && cn->peer->throttled){
+          cn->peer->throttled = 0;
+          if (!read_client(cn->peer)){
+            close_session(cn->session);
+          }
+        }
+      }
+    }
+
+    /* carry on reading from connections that used up their read budget, so that
+       one busy client can't keep the others waiting */
+    struct conn *rc = ready_head;
+    ready_head = 0;
+    while (rc){
+      struct conn *next = rc->next_ready;
+      rc->ready = 0;
+      if (rc->fd >= 0 && !read_client(rc)){
+        close_session(rc->session);
+      }
+      rc = next;
+    }
+
+    flush_busy();
+
+    /* sessions closed above may still have been referenced by later events in the
+       batch, so they are only released once the whole batch has been handled */
+    struct conn **rp = &ready_head;
+    while (*rp){
+      if ((*rp)->fd < 0){
+        (*rp)->ready = 0;
+        *rp = (*rp)->next_ready;
+      }else{
+        rp = &(*rp)->next_ready;
+      }
+    }
+    reap_sessions();
+  }
+}
+
+/* send as many queued messages as we can from every session with queued messages */
+void flush_busy()
+{
+  struct session *s = busy_head;
+  while (s){
+    struct session *next = s->next;
+    if (!flush_session(s)){
+      close_session(s);
+    }
+    s = next;
+  }
+}
+
+/* free closed sessions, once the engine has no more use for them */
+void reap_sessions()
+{
+  struct session **sp = &dead_head;
+  while (*sp){
+    struct session *s = *sp;
+    if (s->conn[0].ops || s->conn[1].ops){
+      /* io_uring requests still in flight will refer to it */
+      sp = &s->next;
+      continue;
+    }
+    *sp = s->next;
+    int i;
+    for(i = 0; i < 2; i++){
+      struct conn *c = &s->conn[i];
+      METRIC_ADD(metrics, queued, -c->msq->count);
+      free_queue(c->msq);
+      for(; c->out_count; c->out_count--){
+        msg_release(&c->out[c->out_first]);
+        c->out_first = (c->out_first + 1) % c->out_size;
+      }
+      free(c->out);
+      free(c->us);
+      if (c->in) chunk_unref(c->in);
+    }
+    free(s);
+  }
+}
 
-  // accept() two client connections
+/*
+ * accept() every pending client connection (epoll engine).
+ */
+void accept_clients(int welcomesockfd)
+{
+  struct sockaddr_in cli_addr;
+  socklen_t clilen;
+  int fd;
+  while(1){
+    clilen = sizeof(cli_addr);
+    fd = accept4(welcomesockfd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK);
+    if (fd < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      /* e.g. out of file descriptors: report it, but keep serving existing sessions */
+      log_perror("ERROR on accept");
+      return;
+    }
+    add_client(fd);
+  }
+}
+
+/*
+ * Clients are paired in the order they arrive: the first of a pair is parked (not yet
+ * watched by the engine, so anything it sends waits in the kernel) until a partner
+ * connects and a session is created.  The parking place is shared by all workers, as
+ * the kernel picks a welcome socket per connection and partners may land on different
+ * workers; whichever accepts the second client runs the session.  (So with -t, a
+ * busy worker can pair clients slightly out of the order in which they connected.)
+ */
+void add_client(int fd)
+{
+  /* messages are written whole, and delaying them is up to -l: don't let Nagle's
+     algorithm hold small ones back until the client's TCP acks the last */
+  int on = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    log_perror("ERROR setting TCP_NODELAY");
+  pthread_mutex_lock(&lobby_lock);
+  int partner = waiting_fd;
+  int partner_uring = waiting_uring;
+  if (partner < 0){
+    waiting_fd = fd;
+    waiting_uring = uring_active;
+  }else{
+    waiting_fd = -1;
+  }
+  pthread_mutex_unlock(&lobby_lock);
+  if (partner < 0){
+    log_printf(" client connection accept()ed, waiting for a partner\n");
+    return;
+  }
+  if (partner_uring != uring_active){
+    /* accept()ed by a worker running the other engine: match this one's sockets */
+    int fl = fcntl(partner, F_GETFL);
+    fcntl(partner, F_SETFL, uring_active ? fl & ~O_NONBLOCK : fl | O_NONBLOCK);
+  }
+  struct session *s = make_session(partner, fd);
+  log_printf(" client connection accept()ed, session %d started (%d live)\n",
+             s->id, __atomic_load_n(&session_count, __ATOMIC_RELAXED));
+}
+
+/* create a session for two accept()ed client sockets and start watching them */
+struct session *make_session(int fd0, int fd1)
+{
+  struct session *s = (struct session*)malloc(sizeof(struct session));
+  if (!s) error("ERROR: malloc() failed in make_session()\n");
+  bzero(s, sizeof(struct session));
+  s->id = __atomic_fetch_add(&session_ids, 1, __ATOMIC_RELAXED);
+  /* count in the metrics session table, where urs-stat can see the session, if it has room */
+  s->slot = session_slot_open(metrics_shm, worker_id, s->id);
   int i;
   for(i = 0; i < 2; i++){
-    clilen = sizeof(cli_addr[i]);
-    sessionsockfd[i] = accept(welcomesockfd, (struct sockaddr *) &cli_addr[i], &clilen);
-    if (sessionsockfd[i] < 0){
-      error("ERROR on accept");
-    }
-    fprintf(stderr, " client connection %d accept()ed\n", i);
-  }
-
-  // two sockets, therefore need to use select()/poll() to check for readiness so we don't block
-  poll_array[0].fd = sessionsockfd[0];
-  poll_array[0].events = POLLIN;
-  poll_array[1].fd = sessionsockfd[1];
-  poll_array[1].events = POLLIN;
-  int loopcount = 1;
-  memset(buffer[0],'\0',BUFSIZE);
-  memset(buffer[1],'\0',BUFSIZE);
-  buf_insert[0] = 0;
-  buf_insert[1] = 0;
-
-  /* create two message queues */
-  msq[0] = make_queue();
-  msq[1] = make_queue(); 
-
-  /* initialise byte counters */
-  client_bytes[0] = 0;
-  client_bytes[1] = 0;
-
-  /* zero client time stamps */
-  client_start[0] = 0;
-  client_start[1] = 0;
-  client_latest[0] = 0;
-  client_latest[1] = 0;
-
-  /* loop forever, reading input from either socket and re-writing to the other */
+    struct conn *c = &s->conn[i];
+    c->fd = i?fd1:fd0;
+    c->stats = s->slot ? &s->slot->dir[i] : &s->stats[i];
+    c->channel = i;
+    c->msq = make_queue();
+    c->session = s;
+    c->peer = &s->conn[1-i];
+    /* a stream per direction, so that each direction's impairments depend only on
+       the seed, the session id and that direction's own messages */
+    rng_seed(&c->rng, flag_seed, 2ULL * s->id + i);
+  }
+  for(i = 0; i < 2; i++){
+    struct conn *c = &s->conn[i];
+#ifdef URS_HAVE_URING
+    if (uring_active){
+      uring_arm_recv(c);
+      continue;
+    }
+#endif
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+      error("ERROR adding client socket to epoll set");
+  }
+  __atomic_add_fetch(&session_count, 1, __ATOMIC_RELAXED);
+  METRIC_ADD(metrics, sessions_started, 1);
+  return s;
+}
+
+/* close both sockets of a session; the session itself is freed by reap_sessions() */
+void close_session(struct session *s)
+{
+  if (s->conn[0].fd < 0){
+    /* already closed */
+    return;
+  }
+  struct session_dir *d0 = s->conn[0].stats, *d1 = s->conn[1].stats;
+  log_printf("closing session %d: client_bytes[0]:%llu client_bytes[1]:%llu msgs:%llu/%llu dropped:%llu/%llu "
+             "corrupted:%llu/%llu reordered:%llu/%llu duplicated:%llu/%llu rejected:%llu/%llu\n",
+             s->id, d0->bytes_in, d1->bytes_in, d0->msgs_in, d1->msgs_in,
+             d0->dropped, d1->dropped, d0->corrupted, d1->corrupted, d0->reordered, d1->reordered,
+             d0->duplicated, d1->duplicated, d0->rejected, d1->rejected);
+  METRIC_ADD(metrics, sessions_closed, 1);
+  if (s->slot){
+    /* the table is for live sessions: anything counted from now on is kept in the session */
+    memcpy(s->stats, s->slot->dir, sizeof(s->stats));
+    session_slot_close(s->slot);
+    s->slot = 0;
+    s->conn[0].stats = &s->stats[0];
+    s->conn[1].stats = &s->stats[1];
+  }
+  if (log_level >= LOG_MSG) dump_pool_stats();
+  if (s->busy){
+    /* unlink from busy list */
+    if (s->prev) s->prev->next = s->next; else busy_head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->busy = 0;
+  }
+  int i;
+  for(i = 0; i < 2; i++){
+    struct conn *c = &s->conn[i];
+#ifdef URS_HAVE_URING
+    if (uring_active){
+      /* in-flight requests hold on to the socket regardless of close(), so make
+         them finish: shutdown() ends any pending recv()/send() */
+      shutdown(c->fd, SHUT_RDWR);
+      if (c->recv_armed) uring_cancel_recv(c);
+    }
+#endif
+    /* close() also removes the socket from the epoll set */
+    close(c->fd);
+    c->fd = -1;
+  }
+  s->prev = 0;
+  s->next = dead_head;
+  dead_head = s;
+  __atomic_sub_fetch(&session_count, 1, __ATOMIC_RELAXED);
+}
+
+/* put a session with newly queued messages on the busy list (if it isn't already there) */
+void mark_busy(struct session *s)
+{
+  if (s->busy) return;
+  s->busy = 1;
+  s->prev = 0;
+  s->next = busy_head;
+  if (busy_head) busy_head->prev = s;
+  busy_head = s;
+}
+
+/* epoll_wait() timeout in milliseconds: the earliest send time over all busy sessions.
+   Blocked connections can't send anything until EPOLLOUT wakes us, so their queues
+   are left out. */
+int next_timeout_milli()
+{
+  int timeout = -1; // block indefinitely if nothing is queued anywhere
+  struct session *s;
+  for(s = busy_head; s; s = s->next){
+    struct mq *queues[2];
+    int q_count = 0;
+    if (!s->conn[0].blocked) queues[q_count++] = s->conn[0].msq;
+    if (!s->conn[1].blocked) queues[q_count++] = s->conn[1].msq;
+    if (!q_count) continue;
+    int t = get_poll_timeout_milli(queues, q_count);
+    if (timeout < 0 || t < timeout){
+      timeout = t;
+    }
+    if (!timeout) break;
+  }
+  return timeout;
+}
+
+/*
+ * Drain an edge-triggered client socket: read() until it would block, processing
+ * complete messages as we go so the buffer never has to hold more than one, and
+ * passing anything already due straight on to the peer.  After READBUDGET reads the
+ * connection goes on the ready list to be resumed on the next pass of the loop.
+ * Returns 0 if the session should be closed.
+ *
+ * Note that we need to process newline-terminated messages, but TCP does NOT
+ * preserve message boundaries, so we need to cater for multiple and/or partial
+ * messages (lines) per read().  Strategy is to read() into the free space at the
+ * end of the connection's input chunk, and then hand out any complete lines as
+ * slices of the chunk, leaving any incomplete line at the head to be completed by
+ * the next read().
+ */
+int read_client(struct conn *c)
+{
+  int reads = 0;
   while(1){
-    /* first-cut poll() implementation ...
-       * Ignore the risk of output socket not being writeable ... for now, at least.
-       * poll() must wait for a finite time only, because there may be queued message whose
-         time-to-send has arrived. If we use a fixed timeout value, we have to trade off
-         between lumpiness of latency time resolution and inefficiency tending towards
-         busy-waiting.  But it is possible to ask each queue for the time its next message
-         (if any) is due to be sent, and calculate the offset between now and the earliest
-         send time to use as our poll() timeout.  The queues are sorted by send time, so
-         this query is an O(1) operation.  If both queues are empty, we set the poll()
-         timeout to INT_MAX milliseconds, which is longer than the program is going to be
-         left running, and in that case poll() will block until input arrives. */
-    int timeout = get_poll_timeout_milli(msq, 2);
-    if (flag_verbose > 2) fprintf(stderr, "DEBUG: get_poll_timeout_milli(): %d\n", timeout);
-    poll(poll_array, 2, timeout);
-
-    /* Note that we need to process newline-terminated messages, but TCP does NOT
-       preserve message boundaries, so we need to cater for multiple and/or partial
-       messages (lines) per read().  Strategy is to append read() data into a
-       persistent buffer, and then shuffle out any complete lines one-by-one,
-       leaving any incomplete line in the front of the buffer to be appended to by
-       the next read(). */
-    int q = 0; // id of throughput queue matches input socket
-    char arrow = '>';
-    for(q = 0; q < 2; q++){
-      arrow = q?'<':'>';
-      if (poll_array[q].revents & POLLIN){
-        /* append input from socket to buffer */
-        buf_insert[q] = strlen(buffer[q]);
-        n = read(sessionsockfd[q],buffer[q]+buf_insert[q],BUFSIZE-1-buf_insert[q]);
-        if (n < 0) error("ERROR reading from sessionsockfd[q]");
-        if (n == 0) error("Reached EOF on socket. Assume socket was abandoned by other end.");
-        /* add to count of client bytes received - used for calculating protocol "efficiency" */
-        client_bytes[q] += n;
-        fprintf(OUT, "client_bytes[0]:%d client_bytes[1]:%d total:%d\n",
-                client_bytes[0], client_bytes[1], client_bytes[0] + client_bytes[1]);
-        /* update and report client timers */
-        long long now = now64();
-        if (!client_start[q]){
-          client_start[q] = now;
-          fprintf(OUT, "client %d timer initialised: %lld\n", q, client_start[q]);
-        }
-        client_latest[q] = now;
-        fprintf(OUT, "client 0 elapsed us: %lld   client 1 elapsed us: %lld\n", 
-                (client_latest[0] - client_start[0]) / 1000, (client_latest[1] - client_start[1]) / 1000);
-        /* identify and individually process any/all newline-terminated messages */
-        while(enqueue_message(q)){}
+    if (c->peer->blocked){
+      /* Backpressure: the peer isn't keeping up with what we already have for it,
+         so leave further input in the kernel (and let TCP slow the sender down)
+         until the peer's socket drains. */
+      c->throttled = 1;
+      return 1;
+    }
+    if (reads++ == READBUDGET){
+      if (!c->ready){
+        c->ready = 1;
+        c->next_ready = ready_head;
+        ready_head = c;
       }
+      return 1;
     }
-    if (flag_verbose > 1){
-      dump_queue(msq[0]);
-      dump_queue(msq[1]);
+    make_room(c);
+    int n = recv(c->fd, c->in->data+c->tail, c->in->size-c->tail, MSG_DONTWAIT);
+    if (n < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        release_idle(c);
+        return 1;
+      }
+      if (errno == EINTR) continue;
+      log_perror("ERROR reading from client socket");
+      return 0;
+    }
+    if (n == 0){
+      log_printf("Reached EOF on socket. Assume socket was abandoned by other end.\n");
+      return 0;
+    }
+    if (!received(c, n)){
+      return 0;
     }
-    /* send as many queued messages as we can, alternating between queues until both are empty */
-    int sent[2];
-    do{
-      sent[0] = send_message(0);
-      sent[1] = send_message(1);
-    }while (sent[0] || sent[1]);
   }
+}
 
-  // do we even ever get here?
-  fprintf(stderr, "closing sockets\n");
-  close(sessionsockfd[0]);
-  close(sessionsockfd[1]);
-  close(welcomesockfd);
-  return 0; 
+/*
+ * Process n bytes just placed at the tail of a connection's input chunk (by either
+ * engine): update the client statistics, queue every complete message for the peer,
+ * and pass on anything already due.  Returns 0 if the session should be closed.
+ */
+int received(struct conn *c, int n)
+{
+  struct conn *c0 = &c->session->conn[0];
+  struct conn *c1 = &c->session->conn[1];
+  c->tail += n;
+  /* add to count of client bytes received - used for calculating protocol "efficiency" */
+  METRIC_ADD(c->stats, bytes_in, n);
+  METRIC_ADD(metrics, bytes_in, n);
+  LOG(LOG_MSG, "session %d client_bytes[0]:%llu client_bytes[1]:%llu total:%llu\n", c->session->id,
+      c0->stats->bytes_in, c1->stats->bytes_in, c0->stats->bytes_in + c1->stats->bytes_in);
+  /* update and report client timers */
+  long long now = now64();
+  if (!c->client_start){
+    c->client_start = now;
+    LOG(LOG_MSG, "client %d timer initialised: %lld\n", c->channel, c->client_start);
+  }
+  c->client_latest = now;
+  LOG(LOG_MSG, "client 0 elapsed us: %lld   client 1 elapsed us: %lld\n",
+      (c0->client_latest - c0->client_start) / 1000, (c1->client_latest - c1->client_start) / 1000);
+  /* identify and individually process any/all newline-terminated messages */
+  while(enqueue_message(c)){}
+  return c->peer->blocked || flush_conn(c->peer);
+}
+
+/* nothing buffered and nothing queued from the input chunk: don't hold on to it
+   while the connection is idle */
+void release_idle(struct conn *c)
+{
+  if (c->in && c->head == c->tail && c->in->refs == 1){
+    chunk_unref(c->in);
+    c->in = 0;
+  }
 }
 
 /*
- * Check buffered input from input specified socket.  If a newline-terminated message
- * is present, 'process' it (i.e. place it in the opposite-numbered send queue for
- * later output on the corresponding socket), and slide remaining buffer content
- * forwards to remove the processed message from the read buffer.
+ * Make sure there is free space at the end of a connection's input chunk.
+ * The chunk is used like a ring buffer that never wraps: once everything in it has
+ * been handed out, head and tail go back to the start. A partial message left at the
+ * end is slid to the front if the chunk is ours alone and the message fills no more
+ * than half of it; otherwise it is copied into a fresh chunk, which is doubled in size
+ * until the message fills no more than half of it. Either way only the partial message
+ * is copied. The doubling is bounded because enqueue_message() discards any message
+ * that grows beyond flag_max_line bytes.
  */
-int enqueue_message(int channel)
+void make_room(struct conn *c)
+{
+  if (!c->in){
+    c->in = chunk_new(flag_read_size);
+    c->head = c->scan = c->tail = 0;
+    return;
+  }
+  if (c->head == c->tail && c->in->refs == 1){
+    /* everything has been consumed and nothing refers to the chunk: rewind */
+    c->head = c->scan = c->tail = 0;
+  }
+  if (c->tail < c->in->size){
+    return;
+  }
+  int partial = c->tail - c->head;
+  if (c->in->refs == 1 && partial <= c->in->size / 2){
+    memmove(c->in->data, c->in->data + c->head, partial);
+  }else{
+    int size = flag_read_size;
+    while (size - CHUNK_OVERHEAD < 2 * partial){
+      size *= 2;
+    }
+    struct chunk *fresh = chunk_new(size);
+    memcpy(fresh->data, c->in->data + c->head, partial);
+    chunk_unref(c->in);
+    c->in = fresh;
+  }
+  c->scan -= c->head;
+  c->tail = partial;
+  c->head = 0;
+}
+
+/*
+ * Check buffered input from the specified connection.  If a newline-terminated message
+ * is present, 'process' it (i.e. place a slice of the input chunk holding it in the
+ * peer's send queue for later output on the peer's socket), and advance the head of
+ * the buffer past it.  The newline search resumes where the last one gave up, so no
+ * input byte is scanned twice.
+ */
+int enqueue_message(struct conn *cn)
 {
   #ifdef DEBUG
     fprintf(stderr, "DEBUG: starting enqueue_message()\n");
   #endif
-  int j = 0;
-  char c = 0;
-  char *msg = 0;
   char arrow = '>';
-  arrow = channel?'<':'>';
+  arrow = cn->channel?'<':'>';
+  char *data = cn->in->data;
 
-  switch (flag_verbose){
-    case 0:
-      break;
-    case 1:
-      dumpbuf(buffer[channel],BUFSIZE);
-      break;
-    default:
-      dumpbuf(buffer[0],BUFSIZE);
-      dumpbuf(buffer[1],BUFSIZE);
-  }
-  while(buffer[channel][j] && buffer[channel][j] != '\n' && j < BUFSIZE){
-    j++;
+  if (log_level >= LOG_DUMP){
+    dumpbuf(data+cn->head,cn->tail-cn->head);
+    if (log_level >= LOG_DEBUG && cn->peer->in)
+      dumpbuf(cn->peer->in->data+cn->peer->head,cn->peer->tail-cn->peer->head);
   }
-  // j is now the index of a newline or a null or the end of the buffer ... but which?
-  if (j >= BUFSIZE){
-    fprintf(stderr, "Input message too long for buffer. Aborting.\n");
-    exit(0);
+  char *nl = memchr(data+cn->scan, '\n', cn->tail-cn->scan);
+  if (nl && (cn->discarding || nl+1-(data+cn->head) > flag_max_line)){
+    /* end of an overlong message: drop it, but carry on with the rest of the input */
+    if (!cn->discarding){
+      LOG(LOG_MSG, "#rejected# %c message longer than %d bytes\n", arrow, flag_max_line);
+    }
+    cn->discarding = 0;
+    METRIC_ADD(cn->stats, rejected, 1);
+    METRIC_ADD(metrics, rejected, 1);
+    cn->head = cn->scan = nl+1-data;
+    return 1;
   }
-  if (buffer[channel][j] == '\n'){
+  if (nl){
     // Houston, we have a newline-terminated message!
-    j++; // increment j to include newline in message string
-    msg = malloc(j+1);
-    memset(msg,'\0',j+1);
-    strncpy(msg,buffer[channel],j);
-    memmove(buffer[channel], buffer[channel]+j, BUFSIZE-j);
-    memset(buffer[channel]+BUFSIZE-j,'\0',j);
+    struct msg msg;
+    msg.chunk = cn->in;
+    msg.data = data+cn->head;
+    msg.len = nl+1-msg.data; // include newline in message
+    cn->in->refs++;
+    cn->head = cn->scan = nl+1-data;
+    METRIC_ADD(cn->stats, msgs_in, 1);
+    METRIC_ADD(metrics, msgs_in, 1);
     /* randomly choose whether to forward this message or not */
     int inverseDropRate = 0;
     switch (flag_drop){
@@ -298,142 +847,541 @@ int enqueue_message(int channel)
         break;
     }
     /* If inverseDropRate is zero, don't divide by zero(!), and don't drop messages. */
-    if(inverseDropRate?rand()%inverseDropRate:1){
+    if(inverseDropRate?rng_below(&cn->rng, inverseDropRate):1){
+      struct mq *q = cn->peer->msq;
       /* randomly choose whether to corrupt this message or not */
-      randomly_corrupt(msg);
+      if (randomly_corrupt(&msg, &cn->rng)){
+        METRIC_ADD(cn->stats, corrupted, 1);
+        METRIC_ADD(metrics, corrupted, 1);
+      }
       /* if reordering is chosen, set additional delay on about 20% of messages */
-      /* place this message into opposite-numbered send queue for later writing to socket */
-      enqueue(msq[1-channel], msg, flag_latency);
-      if (rand()%100 < flag_reorder_rate){
+      /* place this message into the peer's send queue for later writing to its socket */
+      struct msg dup = msg;
+      enqueue(q, &msg, flag_latency);
+      METRIC_ADD(metrics, queued, 1);
+      if ((int)rng_below(&cn->rng, 100) < flag_reorder_rate){
         #ifdef DEBUG
           fprintf(stderr, "DEBUG: enqueue_message(): 1.3\n");
         #endif
-        reorder(msq[1-channel], flag_reorder_step);
+        int step = flag_reorder_step;
+        while (!step){
+          /* step is zero, so randomise it in the range -5..+5 */
+          step = (int)rng_below(&cn->rng, 11) - 5;
+        }
+        reorder(q, step);
+        METRIC_ADD(cn->stats, reordered, 1);
+        METRIC_ADD(metrics, reordered, 1);
         #ifdef DEBUG
           fprintf(stderr, "DEBUG: enqueue_message(): 1.4\n");
         #endif
-        fprintf(OUT,"#reordered#");
+        LOG(LOG_MSG, "#reordered#");
       }
-      fprintf(OUT,"#forwarded# %c %s", arrow, msg);
-      /* randomly add duplicates, including possibly duplicates of duplicates */
+      LOG(LOG_MSG, "#forwarded# %c %.*s", arrow, dup.len, dup.data);
+      /* randomly add duplicates, including possibly duplicates of duplicates;
+         each one is another reference to the same slice of the input chunk */
       int duplicate_count = 1;
-      while (rand()%100 < flag_duplicate_rate){
-        enqueue(msq[1-channel], strdup(msg), flag_latency + duplicate_count++);
-        fprintf(OUT,"#duplicate# %c %s", arrow, msg);
+      while ((int)rng_below(&cn->rng, 100) < flag_duplicate_rate){
+        dup.chunk->refs++;
+        enqueue(q, &dup, flag_latency + duplicate_count++);
+        METRIC_ADD(cn->stats, duplicated, 1);
+        METRIC_ADD(metrics, duplicated, 1);
+        METRIC_ADD(metrics, queued, 1);
+        LOG(LOG_MSG, "#duplicate# %c %.*s", arrow, dup.len, dup.data);
       }
+      mark_busy(cn->session);
     }else{
-      fprintf(OUT,"#dropped# %c %s", arrow, msg);
+      LOG(LOG_MSG, "#dropped# %c %.*s", arrow, msg.len, msg.data);
+      METRIC_ADD(cn->stats, dropped, 1);
+      METRIC_ADD(metrics, dropped, 1);
+      msg_release(&msg);
     }
     return 1;
+  }else if (cn->discarding || cn->tail-cn->head > flag_max_line){
+    /* already too long to be accepted: discard what we have of it, and the rest of
+       it as it arrives, rather than let the buffer grow without limit */
+    if (!cn->discarding){
+      LOG(LOG_MSG, "#rejected# %c message longer than %d bytes\n", arrow, flag_max_line);
+      cn->discarding = 1;
+    }
+    cn->head = cn->scan = cn->tail;
+    return 0;
   }else{
+    /* no complete message yet: remember how far we've looked */
+    cn->scan = cn->tail;
     #ifdef DEBUG
-      fprintf(stderr,"---no newline found in buffer[%d]:%s:\n",channel,buffer[channel]);
+      fprintf(stderr,"---no newline found in buffer[%d]:%.*s:\n",cn->channel,cn->tail-cn->head,data+cn->head);
     #endif
     return 0;
   }
 }
 
+/* append a message to the end of a connection's output ring, growing it if needed */
+void out_push(struct conn *c, struct msg *m)
+{
+  if (c->out_count == c->out_size){
+    int size = c->out_size ? c->out_size * 2 : IOVBATCH;
+    struct msg *out = (struct msg*)malloc(size * sizeof(struct msg));
+    if (!out) error("ERROR: malloc() failed in out_push()\n");
+    int i;
+    for(i = 0; i < c->out_count; i++){
+      out[i] = c->out[(c->out_first + i) % c->out_size];
+    }
+    free(c->out);
+    c->out = out;
+    c->out_first = 0;
+    c->out_size = size;
+  }
+  c->out[(c->out_first + c->out_count) % c->out_size] = *m;
+  c->out_count++;
+}
+
 /*
- * Take one message from specified send queue, and write() it into the corresponding socket
+ * Write everything that is due to a connection's socket: any output left over from
+ * an earlier partial write, followed by every message now due from its send queue,
+ * gathered up to IOVBATCH at a time into each writev().  The socket is non-blocking;
+ * if its buffer fills up, whatever is left stays in the output ring, and the
+ * connection is marked blocked until epoll reports it writable again.  (The io_uring
+ * engine hands the output ring to uring_send() instead.)
+ * Returns 0 on a write error.
  */
-int send_message(int sq)
+int flush_conn(struct conn *c)
 {
   #ifdef DEBUG
-  fprintf(stderr, "DEBUG: starting send_message()\n");
+  fprintf(stderr, "DEBUG: starting flush_conn()\n");
   #endif
-  char *msg = 0;
-  if (msg = dequeue(msq[sq])){
-    /* Write to socket (at last!)
-     * NOTE: this may block if the socket's buffer is full. But that'll only happen
-     * temporarily, or if there's a problem in the way the client operates.
-     * /
-    int n = write(sessionsockfd[sq],msg,strlen(msg));
-    if (n < 0)
-       error("ERROR writing to sessionsockfd[sq]");
-    free(msg);
-    return 1;
-  }else{
-    /* nothing to send from this queue at this time */
-    return 0;
+  struct iovec iov[IOVBATCH];
+  struct msg msg;
+  /* everything due goes after any leftovers, to keep the order */
+  while (dequeue(c->msq, &msg)){
+    out_push(c, &msg);
+    METRIC_ADD(metrics, queued, -1);
+  }
+#ifdef URS_HAVE_URING
+  if (uring_active){
+    return uring_send(c);
+  }
+#endif
+  while (c->out_count){
+    int i, n;
+    for(i = 0; i < c->out_count && i < IOVBATCH; i++){
+      struct msg *m = &c->out[(c->out_first + i) % c->out_size];
+      int skip = i ? 0 : c->out_offset;
+      iov[i].iov_base = m->data + skip;
+      iov[i].iov_len = m->len - skip;
+    }
+    /* Write to socket (at last!) */
+    n = writev(c->fd, iov, i);
+    if (n < 0){
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        c->blocked = 1;
+        return 1;
+      }
+      log_perror("ERROR writing to client socket");
+      return 0;
+    }
+    out_written(c, n);
   }
+  c->blocked = 0;
+  return 1;
 }
 
+/* release every message in the output ring that has now been written completely,
+   recording how long each spent in the relay */
+void out_written(struct conn *c, int n)
+{
+  long long now = now64();
+  METRIC_ADD(metrics, bytes_out, n);
+  while (c->out_count){
+    struct msg *m = &c->out[c->out_first];
+    int left = m->len - c->out_offset;
+    if (n < left){
+      c->out_offset += n;
+      break;
+    }
+    n -= left;
+    c->out_offset = 0;
+    METRIC_ADD(metrics, msgs_out, 1);
+    metric_record_queued(metrics, now - m->queued_at);
+    msg_release(m);
+    c->out_first = (c->out_first + 1) % c->out_size;
+    c->out_count--;
+  }
+}
+
+/*
+ * Send everything that is due from the session's queues, except to a connection
+ * that is blocked (that resumes on EPOLLOUT).  Sessions whose queues are now empty
+ * leave the busy list.  Returns 0 if the session should be closed.
+ */
+int flush_session(struct session *s)
+{
+  if (log_level >= LOG_DEBUG){
+    dump_queue(s->conn[0].msq);
+    dump_queue(s->conn[1].msq);
+  }
+  int i;
+  for(i = 0; i < 2; i++){
+    if (!s->conn[i].blocked && !flush_conn(&s->conn[i])) return 0;
+  }
+  if (get_next_send_time_micro(s->conn[0].msq) == LLONG_MAX &&
+      get_next_send_time_micro(s->conn[1].msq) == LLONG_MAX){
+    /* unlink from busy list */
+    if (s->prev) s->prev->next = s->next; else busy_head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->busy = 0;
+  }
+  return 1;
+}
+
+#ifdef URS_HAVE_URING
+/*
+ * The io_uring engine (-U).  Instead of being told when a socket is ready and then
+ * making the system calls ourselves, we keep requests outstanding in the kernel and
+ * act on their completions:
+ *  - one multishot accept() on the welcome socket, which completes once per client;
+ *  - one multishot recv() per connection, which completes every time data arrives,
+ *    taking a buffer from a shared ring of provided buffers (so idle connections
+ *    don't tie up a receive buffer each);
+ *  - for output, up to URING_LINKS linked sendmsg()s per connection, each gathering
+ *    up to IOVBATCH messages from the output ring.
+ * The wait for completions carries the queue timeout itself (IORING_ENTER_EXT_ARG),
+ * so delayed messages need no timeout requests of their own.
+ *
+ * Backpressure works as with epoll, except that a connection counts as blocked while
+ * URING_BACKLOG or more messages are waiting to be sent to it: its peer's recv() is
+ * then cancelled (throttled), and re-armed once the sends have caught up.
+ */
+#define URING_ENTRIES 4096          // submission queue size
+#define URING_GROUP 0               // provided buffer group id
+#define URING_BUFFERS 256           // provided buffers shared by all connections (power of two)
+#define URING_BUFSIZE 16384         // size of each provided buffer
+#define URING_LINKS 2               // most linked sendmsg()s in flight per connection
+#define URING_BACKLOG (4*IOVBATCH)  // messages waiting to be sent before we throttle the peer
+
+/* request type, in the low bits of each request's user_data (the rest is the conn) */
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_CANCEL 3
+#define OP_MASK 3
+
+/* sendmsg() arguments must stay put until the request completes */
+struct uring_send{
+  struct msghdr mh[URING_LINKS];
+  struct iovec iov[URING_LINKS*IOVBATCH];
+};
+
+__thread struct uring ring;
+__thread int accept_armed = 0;          // non-zero while the multishot accept() is outstanding
+__thread long long accept_resume = 0;   // after an accept() error: time to try again
+
+void uring_loop(int welcomesockfd)
+{
+  if (uring_init(&ring, URING_ENTRIES) < 0){
+    perror("ERROR setting up io_uring");
+    return;
+  }
+  if (uring_setup_buffers(&ring, URING_GROUP, URING_BUFFERS, URING_BUFSIZE) < 0){
+    perror("ERROR registering io_uring buffers");
+    uring_exit(&ring);
+    return;
+  }
+  /* completions arrive when there is something to do, so the sockets themselves can
+     be blocking; accepted sockets inherit this */
+  fcntl(welcomesockfd, F_SETFL, fcntl(welcomesockfd, F_GETFL) & ~O_NONBLOCK);
+  uring_active = 1;
+  fprintf(stderr, "using io_uring\n");
+
+  while(1){
+    int timeout = next_timeout_milli();
+    if (!accept_armed){
+      long long wait = accept_resume - now64();
+      if (wait <= 0){
+        uring_arm_accept(welcomesockfd);
+      }else if (timeout < 0 || wait / 1000 + 1 < timeout){
+        timeout = wait / 1000 + 1;
+      }
+    }
+    LOG(LOG_DEBUG, "DEBUG: next_timeout_milli(): %d\n", timeout);
+    /* the end of a batch of work: write out what it logged before going to sleep */
+    log_flush();
+    if (uring_submit_and_wait(&ring, timeout) < 0){
+      error("ERROR on io_uring_enter()");
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&ring))){
+      unsigned long long data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_cqe_seen(&ring);
+      struct conn *c = (struct conn *)(unsigned long)(data & ~(unsigned long long)OP_MASK);
+      switch(data & OP_MASK){
+        case OP_ACCEPT:
+          if (!(flags & IORING_CQE_F_MORE)) accept_armed = 0;
+          if (res >= 0){
+            add_client(res);
+          }else{
+            /* e.g. out of file descriptors: report it, keep serving existing sessions,
+               and try again shortly */
+            errno = -res;
+            log_perror("ERROR on accept");
+            accept_resume = now64() + 100000;
+          }
+          break;
+        case OP_RECV:
+          if (!(flags & IORING_CQE_F_MORE)){
+            c->ops--;
+            c->recv_armed = 0;
+          }
+          if (flags & IORING_CQE_F_BUFFER){
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (res > 0 && c->fd >= 0 && !uring_received(c, uring_buffer(&ring, bid), res)){
+              close_session(c->session);
+            }
+            uring_recycle_buffer(&ring, bid);
+          }
+          if (c->fd < 0) break;
+          if (res == 0){
+            log_printf("Reached EOF on socket. Assume socket was abandoned by other end.\n");
+            close_session(c->session);
+            break;
+          }
+          if (res < 0 && res != -ENOBUFS && res != -ECANCELED){
+            errno = -res;
+            log_perror("ERROR reading from client socket");
+            close_session(c->session);
+            break;
+          }
+          if (c->peer->blocked){
+            /* backpressure: stop reading until the peer catches up */
+            c->throttled = 1;
+            if (c->recv_armed == 1) uring_cancel_recv(c);
+          }else if (!c->recv_armed){
+            /* ran out of provided buffers, or was cancelled: carry on */
+            uring_arm_recv(c);
+          }
+          break;
+        case OP_SEND:
+          c->ops--;
+          c->sends--;
+          if (res > 0) out_written(c, res);
+          if (c->fd < 0) break;
+          if (res < 0 && res != -ECANCELED){
+            /* ECANCELED: an earlier send in the chain came up short */
+            errno = -res;
+            log_perror("ERROR writing to client socket");
+            close_session(c->session);
+            break;
+          }
+          if (c->sends) break;
+          if (!flush_conn(c)){
+            close_session(c->session);
+            break;
+          }
+          if (!c->blocked && c->peer->throttled){
+            c->peer->throttled = 0;
+            if (!c->peer->recv_armed) uring_arm_recv(c->peer);
+          }
+          break;
+        case OP_CANCEL:
+          c->ops--;
+          break;
+      }
+    }
+
+    flush_busy();
+    reap_sessions();
+  }
+}
+
+/* (re)start the multishot accept() on the welcome socket */
+void uring_arm_accept(int welcomesockfd)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = welcomesockfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = OP_ACCEPT;
+  accept_armed = 1;
+}
+
+/* start a multishot recv() on a connection, drawing on the provided buffers */
+void uring_arm_recv(struct conn *c)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+  sqe->user_data = (unsigned long)c | OP_RECV;
+  c->ops++;
+  c->recv_armed = 1;
+}
+
+/* ask for a connection's multishot recv() to end; its final completion follows */
+void uring_cancel_recv(struct conn *c)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (unsigned long)c | OP_RECV;
+  sqe->user_data = (unsigned long)c | OP_CANCEL;
+  c->ops++;
+  c->recv_armed = 2;
+}
+
+/*
+ * Pass bytes delivered into a provided buffer through the same path as read_client(),
+ * copying them into the connection's input chunk a chunk's worth of room at a time.
+ * Returns 0 if the session should be closed.
+ */
+int uring_received(struct conn *c, char *data, int len)
+{
+  while (len){
+    make_room(c);
+    int n = c->in->size - c->tail;
+    if (n > len) n = len;
+    memcpy(c->in->data + c->tail, data, n);
+    data += n;
+    len -= n;
+    if (!received(c, n)) return 0;
+  }
+  release_idle(c);
+  return 1;
+}
+
+/*
+ * Start sending the connection's output ring, unless sends are already in flight (the
+ * last of them to complete calls flush_conn() again).  Each sendmsg() covers up to
+ * IOVBATCH messages; they are linked so that they go out in order, and MSG_WAITALL
+ * makes a short send break the chain, so the rest is cancelled and resent from where
+ * it stopped.  Messages stay in the ring until written.  Returns 1 (errors arrive as
+ * completions).
+ */
+int uring_send(struct conn *c)
+{
+  if (!c->sends && c->out_count){
+    if (!c->us){
+      c->us = (struct uring_send*)malloc(sizeof(struct uring_send));
+      if (!c->us) error("ERROR: malloc() failed in uring_send()\n");
+    }
+    int links = (c->out_count + IOVBATCH - 1) / IOVBATCH;
+    if (links > URING_LINKS) links = URING_LINKS;
+    uring_reserve(&ring, links);
+    int i = 0, k;
+    for(k = 0; k < links; k++){
+      struct msghdr *mh = &c->us->mh[k];
+      struct iovec *iov = &c->us->iov[k*IOVBATCH];
+      int j;
+      for(j = 0; j < IOVBATCH && i < c->out_count; j++, i++){
+        struct msg *m = &c->out[(c->out_first + i) % c->out_size];
+        int skip = i ? 0 : c->out_offset;
+        iov[j].iov_base = m->data + skip;
+        iov[j].iov_len = m->len - skip;
+      }
+      bzero(mh, sizeof(struct msghdr));
+      mh->msg_iov = iov;
+      mh->msg_iovlen = j;
+      struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = c->fd;
+      sqe->addr = (unsigned long)mh;
+      sqe->len = 1;
+      sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      if (k < links - 1) sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = (unsigned long)c | OP_SEND;
+      c->ops++;
+      c->sends++;
+    }
+  }
+  c->blocked = c->out_count >= URING_BACKLOG;
+  return 1;
+}
+#endif
 
 /* 
  * Randomly choose whether to corrupt this message.
- * Corruption can include changing characters and truncating the string, with or without
- * adding a newline before the null-terminator.  Note that under our line-based protocol,
- * inserting a newline makes the message into two messages, and will (likely) test the 
- * client's ability to separate multiple messages obtained in a single read() from its
- * end of the socket.
+ * Corruption can include changing characters and truncating the message, with or without
+ * a terminating newline.  Note that under our line-based protocol, inserting a newline
+ * makes the message into two messages, and will (likely) test the client's ability to
+ * separate multiple messages obtained in a single read() from its end of the socket.
+ * The message is corrupted in place: its bytes in the input chunk belong to it alone,
+ * and any duplicates of it are only made afterwards.  Returns 1 if it was changed.
  */
-void randomly_corrupt(char *msg)
+int randomly_corrupt(struct msg *m, struct rng *r)
 {
   #ifdef DEBUG
   fprintf(stderr, "DEBUG: starting randomly_corrupt()\n");
   #endif
   /* firstly, decide *whether* to corrupt this message or not */
-  if (rand()%100 >= flag_corrupt_rate){
+  if ((int)rng_below(r, 100) >= flag_corrupt_rate){
     /* leave this message intact */
-    return;
+    return 0;
   }
   /* ok, we decided to corrupt, so display the uncorrupted message */
-  fprintf(stderr, "#corrupting# ");
   int length = 0;
-  length = strlen(msg);
-  dumpbuf(msg, length);
+  length = m->len;
+  if (log_level >= LOG_MSG){
+    log_printf("#corrupting# ");
+    dumpbuf(m->data, length);
+  }
   if (length < 2){
     /* do nothing, because message is an empty line */
-    if (flag_verbose > 0)
-       fprintf(stderr, "randomly_corrupt() doing nothing: string is too short\n");
-    return;
+    LOG(LOG_MSG, "randomly_corrupt() doing nothing: string is too short\n");
+    return 0;
   }
 
   /* next decision is what type of corruption ... */
   switch (flag_corrupt_type){
     case 1:
-      corrupt_character_flip(msg);
+      corrupt_character_flip(m, r);
       break;
     case 2:
-      corrupt_insert_newline(msg);
+      corrupt_insert_newline(m, r);
       break;
     case 3:
-      corrupt_truncate_clean(msg);
+      corrupt_truncate_clean(m, r);
       break;
     case 4:
-      corrupt_truncate_dirty(msg);
+      corrupt_truncate_dirty(m, r);
       break;
     default:
-      fprintf(stderr, "ERROR: no such corruption type implemented (yet): %d\n", flag_corrupt_type);
+      log_printf("ERROR: no such corruption type implemented (yet): %d\n", flag_corrupt_type);
+      return 0;
   }
   /* display the corrupted message */
-  fprintf(stderr, "#corrupted#  ");
-  dumpbuf(msg, length);
+  if (log_level >= LOG_MSG){
+    log_printf("#corrupted#  ");
+    dumpbuf(m->data, length);
+  }
+  return 1;
 }
 
 /*
  * Change a character OTHER than the terminating newline, and not to NULL or newline
  */
-void corrupt_character_flip(char *msg)
+void corrupt_character_flip(struct msg *m, struct rng *r)
 {
   #ifdef DEBUG
     fprintf(stderr, "DEBUG: starting corrupt_character_flip():\n");
   #endif
   int x = 0;
   int i = 0;
-  if (strlen(msg) < 2){
+  if (m->len < 2){
     /* do nothing, because message is an empty line and we are not messing with newlines here */
-    if (flag_verbose > 0)
-       fprintf(stderr, "corrupt_character_flip() doing nothing: string is too short\n");
+    LOG(LOG_MSG, "corrupt_character_flip() doing nothing: string is too short\n");
   }else{
     /* above check should protect us from dividing by zero below */
-    /* munge up to 3 characters. Note: random() may land on the same character more than once. */
+    /* munge up to 3 characters. Note: we may land on the same character more than once. */
     for (i = 1; i <=3; i++){
-      x = random() % (strlen(msg)-1);
-      if (msg[x] != 'X'){
-        msg[x] = 'X';
+      x = rng_below(r, m->len-1);
+      if (m->data[x] != 'X'){
+        m->data[x] = 'X';
       }else{
-        msg[x] = '.';
+        m->data[x] = '.';
       }
     }
   }
@@ -442,41 +1390,40 @@ void corrupt_character_flip(char *msg)
 /*
  * break message in two by changing a random character to a newline
  */
-void corrupt_insert_newline(char *msg)
+void corrupt_insert_newline(struct msg *m, struct rng *r)
 {
   #ifdef DEBUG
   fprintf(stderr, "DEBUG: starting corrupt_insert_newline()\n");
   #endif
   int x = 0;
-  if (strlen(msg) < 2){
+  if (m->len < 2){
     /* do nothing, because message is an empty line and we can't insert another newline here */
-    if (flag_verbose > 0)
-       fprintf(stderr, "corrupt_insert_newline() doing nothing: string is too short\n");
+    LOG(LOG_MSG, "corrupt_insert_newline() doing nothing: string is too short\n");
   } else {
     /* above check should protect us from dividing by zero */
-    x = random() % (strlen(msg)-1);
-    msg[x] = '\n';
+    x = rng_below(r, m->len-1);
+    m->data[x] = '\n';
   }
 }
 
 /* 
  * Do a 'clean' truncation: insert a newline followed by a null
  */
-void corrupt_truncate_clean(char *msg)
+void corrupt_truncate_clean(struct msg *m, struct rng *r)
 {
   #ifdef DEBUG
   fprintf(stderr, "DEBUG: starting corrupt_truncate_clean()\n");
   #endif
   int x = 0;
-  if (strlen(msg) < 2){
+  if (m->len < 2){
     /* do nothing, because message is an empty line and we can't shorten it */
-    if (flag_verbose > 0)
-	fprintf(stderr, "corrupt_truncate_clean() doing nothing: string is too short\n");
+    LOG(LOG_MSG, "corrupt_truncate_clean() doing nothing: string is too short\n");
   }else{
     /* above check should protect us from dividing by zero */
-    x = random() % (strlen(msg)-1);
-    msg[x] = '\n';
-    msg[x+1] = '\0';
+    x = rng_below(r, m->len-1);
+    m->data[x] = '\n';
+    m->data[x+1] = '\0';
+    m->len = x+1;
   }
 }
 
@@ -486,19 +1433,19 @@ void corrupt_truncate_clean(char *msg)
  * It also risks making a message that is longer than the specified max length, so should be used
  * with "short" messages and moderately low corruption rates.
  */
-void corrupt_truncate_dirty(char *msg)
+void corrupt_truncate_dirty(struct msg *m, struct rng *r)
 {
   #ifdef DEBUG
   fprintf(stderr, "DEBUG: starting corrupt_truncate_dirty()\n");
   #endif
   int x = 0;
-  if (strlen(msg) < 2){
+  if (m->len < 2){
     /* do nothing, because message is an empty line and we can't insert another newline here */
-    if (flag_verbose > 0)
-	fprintf(stderr, "corrupt_insert_newline() doing nothing: string is too short\n");
+    LOG(LOG_MSG, "corrupt_insert_newline() doing nothing: string is too short\n");
   } else {
     /* above check should protect us from dividing by zero */
-    x = random() % (strlen(msg)-1);
-    msg[x] = '\0';
+    x = rng_below(r, m->len-1);
+    m->data[x] = '\0';
+    m->len = x;
   }
 }
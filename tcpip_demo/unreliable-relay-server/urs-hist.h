@@ -0,0 +1,29 @@
+/* HDR style histogram buckets, shared by the relay's metrics (urs-metrics.h)
+   and the client's load generator (loadgen.c), which records latencies with
+   the same buckets.
+
+   Values (microseconds) below 2*HIST_SUB are counted exactly, and above that
+   each power of two is split into HIST_SUB buckets, so any recorded value is
+   within 1/HIST_SUB (6.25%) of its bucket's lower bound. Values beyond
+   2^HIST_MAX_EXP go in the last bucket. */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36            // about 19 hours
+#define HIST_BUCKETS (2*HIST_SUB + (HIST_MAX_EXP - HIST_SUB_BITS - 1) * HIST_SUB + 1)
+
+/* histogram bucket for a value */
+static inline int hist_bucket(unsigned long long v){
+  if (v < 2*HIST_SUB) return (int)v;
+  int e = 63 - __builtin_clzll(v);  // v is in [2^e, 2^(e+1))
+  if (e >= HIST_MAX_EXP) return HIST_BUCKETS - 1;
+  return 2*HIST_SUB + (e - HIST_SUB_BITS - 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* smallest value counted in a bucket */
+static inline unsigned long long hist_value(int bucket){
+  if (bucket < 2*HIST_SUB) return bucket;
+  int e = (bucket - 2*HIST_SUB) / HIST_SUB + HIST_SUB_BITS + 1;
+  unsigned long long sub = (bucket - 2*HIST_SUB) % HIST_SUB + HIST_SUB;
+  return sub << (e - HIST_SUB_BITS);
+}
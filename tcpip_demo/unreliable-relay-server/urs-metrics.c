@@ -0,0 +1,151 @@
+/* Relay metrics, optionally shared with other processes through POSIX shared memory */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "urs-util.h"
+#include "urs-metrics.h"
+
+/* shm_open() names start with a slash; let users leave it out */
+static void shm_name(char *out, size_t size, const char *name){
+  snprintf(out, size, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/* Set up slots for 'workers' workers: in a shared memory segment called 'name'
+   (replacing any earlier one), or in private memory if name is 0. */
+struct metrics_shm *metrics_open(const char *name, int workers){
+  struct metrics_shm *shm;
+  size_t size = sizeof(struct metrics_shm) + workers * sizeof(struct metrics) +
+                (size_t)workers * METRICS_SESSIONS * sizeof(struct session_slot);
+  if (name){
+    char path[256];
+    shm_name(path, sizeof(path), name);
+    shm_unlink(path);
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) error("ERROR creating metrics shared memory");
+    if (ftruncate(fd, size) < 0) error("ERROR sizing metrics shared memory");
+    shm = (struct metrics_shm*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) error("ERROR mapping metrics shared memory");
+    close(fd);
+  }else{
+    shm = (struct metrics_shm*)aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!shm) error("ERROR: aligned_alloc() failed in metrics_open()\n");
+  }
+  bzero(shm, size);
+  shm->version = METRICS_VERSION;
+  shm->workers = workers;
+  shm->hist_buckets = HIST_BUCKETS;
+  shm->start_time = now64();
+  shm->session_slots = METRICS_SESSIONS;
+  struct session_slot *slots = metrics_sessions(shm);
+  int i;
+  for (i = 0; i < workers * METRICS_SESSIONS; i++){
+    slots[i].id = -1;
+  }
+  /* readers check the magic number last, once the rest is in place */
+  __atomic_store_n(&shm->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+  return shm;
+}
+
+/* Map an existing segment for reading; returns 0 (with errno set) on failure. */
+struct metrics_shm *metrics_attach(const char *name){
+  char path[256];
+  struct stat st;
+  shm_name(path, sizeof(path), name);
+  int fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct metrics_shm)){
+    close(fd);
+    errno = EINVAL;
+    return 0;
+  }
+  struct metrics_shm *shm = (struct metrics_shm*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) return 0;
+  if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+      shm->version != METRICS_VERSION || shm->hist_buckets != HIST_BUCKETS ||
+      st.st_size < (off_t)(sizeof(struct metrics_shm) + shm->workers * sizeof(struct metrics) +
+                           (size_t)shm->workers * shm->session_slots * sizeof(struct session_slot))){
+    munmap(shm, st.st_size);
+    errno = EINVAL;
+    return 0;
+  }
+  return shm;
+}
+
+/* add up all the workers' slots */
+void metrics_sum(struct metrics_shm *shm, struct metrics *total){
+  int w, i;
+  bzero(total, sizeof(struct metrics));
+  for (w = 0; w < shm->workers; w++){
+    struct metrics *m = &shm->worker[w];
+    total->bytes_in += __atomic_load_n(&m->bytes_in, __ATOMIC_RELAXED);
+    total->bytes_out += __atomic_load_n(&m->bytes_out, __ATOMIC_RELAXED);
+    total->msgs_in += __atomic_load_n(&m->msgs_in, __ATOMIC_RELAXED);
+    total->msgs_out += __atomic_load_n(&m->msgs_out, __ATOMIC_RELAXED);
+    total->dropped += __atomic_load_n(&m->dropped, __ATOMIC_RELAXED);
+    total->corrupted += __atomic_load_n(&m->corrupted, __ATOMIC_RELAXED);
+    total->reordered += __atomic_load_n(&m->reordered, __ATOMIC_RELAXED);
+    total->duplicated += __atomic_load_n(&m->duplicated, __ATOMIC_RELAXED);
+    total->rejected += __atomic_load_n(&m->rejected, __ATOMIC_RELAXED);
+    total->sessions_started += __atomic_load_n(&m->sessions_started, __ATOMIC_RELAXED);
+    total->sessions_closed += __atomic_load_n(&m->sessions_closed, __ATOMIC_RELAXED);
+    total->queued += __atomic_load_n(&m->queued, __ATOMIC_RELAXED);
+    for (i = 0; i < HIST_BUCKETS; i++){
+      total->queued_us[i] += __atomic_load_n(&m->queued_us[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Claim a free session slot in a worker's part of the table (for session id);
+   returns 0 if they are all in use. */
+struct session_slot *session_slot_open(struct metrics_shm *shm, int worker, int id){
+  struct session_slot *slot = metrics_sessions(shm) + worker * shm->session_slots;
+  int i;
+  for (i = 0; i < shm->session_slots; i++, slot++){
+    if (slot->id < 0){
+      bzero(slot->dir, sizeof(slot->dir));
+      slot->worker = worker;
+      slot->start_time = now64();
+      /* readers check the id, so set it last */
+      __atomic_store_n(&slot->id, id, __ATOMIC_RELEASE);
+      return slot;
+    }
+  }
+  return 0;
+}
+
+/* give a slot back */
+void session_slot_close(struct session_slot *slot){
+  __atomic_store_n(&slot->id, -1, __ATOMIC_RELEASE);
+}
+
+/* Copy a live slot, consistently enough for a report; returns 0 if the slot
+   is free, or was reused while it was being copied. */
+int session_slot_read(struct session_slot *slot, struct session_slot *copy){
+  int id = __atomic_load_n(&slot->id, __ATOMIC_ACQUIRE);
+  if (id < 0) return 0;
+  copy->id = id;
+  copy->worker = slot->worker;
+  copy->start_time = slot->start_time;
+  int i;
+  for (i = 0; i < 2; i++){
+    struct session_dir *d = &slot->dir[i], *c = &copy->dir[i];
+    c->bytes_in = __atomic_load_n(&d->bytes_in, __ATOMIC_RELAXED);
+    c->msgs_in = __atomic_load_n(&d->msgs_in, __ATOMIC_RELAXED);
+    c->dropped = __atomic_load_n(&d->dropped, __ATOMIC_RELAXED);
+    c->corrupted = __atomic_load_n(&d->corrupted, __ATOMIC_RELAXED);
+    c->reordered = __atomic_load_n(&d->reordered, __ATOMIC_RELAXED);
+    c->duplicated = __atomic_load_n(&d->duplicated, __ATOMIC_RELAXED);
+    c->rejected = __atomic_load_n(&d->rejected, __ATOMIC_RELAXED);
+  }
+  /* a slot given back and claimed again in the meantime has a new id */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot->id, __ATOMIC_RELAXED) == id;
+}
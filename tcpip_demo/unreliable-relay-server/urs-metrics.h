@@ -0,0 +1,96 @@
+/* Relay metrics: counters for throughput, impairments and queueing, kept per
+   worker thread and optionally published in a POSIX shared memory segment for
+   urs-stat (or any other tool) to read while the relay runs.
+
+   Each worker has a slot of its own, aligned to cache lines, and is the only
+   writer of it, so updates need neither locks nor atomic read-modify-writes:
+   METRIC_ADD() is a plain add whose store is atomic, which is all a reader
+   needs to see consistent (if slightly stale) values. Readers add up the
+   slots of all workers.
+
+   After the workers' slots comes a table of live sessions, session_slots per
+   worker, which again only that worker writes. A session that finds its
+   worker's part of the table full still keeps its counters, but readers
+   don't see them. */
+
+#define METRICS_MAGIC 0x4d535255   // "URSM"
+#define METRICS_VERSION 2
+#define METRICS_SESSIONS 256        // session slots per worker
+
+/* time-spent-queued histogram buckets */
+#include "urs-hist.h"
+
+struct metrics{
+  unsigned long long bytes_in;      // bytes read from clients
+  unsigned long long bytes_out;     // bytes written to clients
+  unsigned long long msgs_in;       // complete messages received
+  unsigned long long msgs_out;      // messages written in full (including duplicates)
+  unsigned long long dropped;
+  unsigned long long corrupted;
+  unsigned long long reordered;
+  unsigned long long duplicated;
+  unsigned long long rejected;      // overlong messages discarded
+  unsigned long long sessions_started;
+  unsigned long long sessions_closed;
+  long long queued;                 // messages waiting in send queues now
+  unsigned long long queued_us[HIST_BUCKETS]; // time from queueing to being written
+} __attribute__((aligned(64)));
+
+/* one direction of a session: the messages from one of its clients */
+struct session_dir{
+  unsigned long long bytes_in;
+  unsigned long long msgs_in;
+  unsigned long long dropped;
+  unsigned long long corrupted;
+  unsigned long long reordered;
+  unsigned long long duplicated;
+  unsigned long long rejected;
+};
+
+/* a live session's counters */
+struct session_slot{
+  int id;                           // session id, or -1 while the slot is free
+  int worker;
+  long long start_time;             // now64() when the session started
+  struct session_dir dir[2];        // messages from client 0, and from client 1
+} __attribute__((aligned(64)));
+
+/* the shared memory segment: a header, then one slot per worker, then the session table */
+struct metrics_shm{
+  unsigned int magic;
+  unsigned int version;
+  int workers;
+  int hist_buckets;
+  long long start_time;             // now64() when the relay started
+  int session_slots;                // per worker
+  struct metrics worker[] __attribute__((aligned(64)));
+};
+
+/* the session table: worker w's slots are [w*session_slots, (w+1)*session_slots) */
+static inline struct session_slot *metrics_sessions(struct metrics_shm *shm){
+  return (struct session_slot*)&shm->worker[shm->workers];
+}
+
+/* add n to one of a worker's counters (only ever called by that worker) */
+#define METRIC_ADD(m, field, n) __atomic_store_n(&(m)->field, (m)->field + (n), __ATOMIC_RELAXED)
+
+static inline void metric_record_queued(struct metrics *m, long long us){
+  METRIC_ADD(m, queued_us[hist_bucket(us < 0 ? 0 : us)], 1);
+}
+
+/* Set up slots for 'workers' workers, and their session tables: in a shared
+   memory segment called 'name' (replacing any earlier one), or in private
+   memory if name is 0. */
+struct metrics_shm *metrics_open(const char *name, int workers);
+/* Map an existing segment for reading; returns 0 (with errno set) on failure. */
+struct metrics_shm *metrics_attach(const char *name);
+/* add up all the workers' slots */
+void metrics_sum(struct metrics_shm *shm, struct metrics *total);
+/* Claim a free session slot in a worker's part of the table (for session id);
+   returns 0 if they are all in use. */
+struct session_slot *session_slot_open(struct metrics_shm *shm, int worker, int id);
+/* give a slot back */
+void session_slot_close(struct session_slot *slot);
+/* Copy a live slot, consistently enough for a report; returns 0 if the slot
+   is free, or was reused while it was being copied. */
+int session_slot_read(struct session_slot *slot, struct session_slot *copy);
@@ -0,0 +1,155 @@
+/* Print the metrics a relay-server started with -M publishes, once or at intervals.
+ * The relay's workers are only ever read, so watching them costs the relay nothing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include "urs-util.h"
+#include "urs-metrics.h"
+
+void print_metrics(struct metrics_shm *shm, struct metrics *m, struct metrics *prev, double secs);
+void print_sessions(struct metrics_shm *shm, struct session_slot *copies);
+int compare_sessions(const void *a, const void *b);
+unsigned long long percentile(struct metrics *m, double p);
+
+int main(int argc, char *argv[]) {
+  int interval = 0;
+  int count = 0;
+  int sessions = 0;
+  int c;
+  while ((c = getopt(argc, argv, "i:n:sh")) != -1){
+    switch(c){
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      case 'n':
+        count = atoi(optarg);
+        break;
+      case 's':
+        sessions = 1;
+        break;
+      case 'h':
+        fprintf(stderr,"Usage: %s [options] name\n", argv[0]);
+        fprintf(stderr,"Print the metrics of a relay-server run with -M name.\n");
+        fprintf(stderr," -i s  Print again every s seconds, with rates over the interval.\n");
+        fprintf(stderr," -n n  Stop after n reports (default: forever with -i, else 1).\n");
+        fprintf(stderr," -s    List the live sessions too, with each direction's counters (client 0/client 1).\n");
+        fprintf(stderr," -h    Print this help message.\n");
+        exit(1);
+      case '?':
+        if (isprint(optopt)){
+          fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+        } else {
+          fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+        }
+        return 1;
+      default:
+        abort();
+    }
+  }
+  if (argc - optind < 1){
+    fprintf(stderr,"Usage: %s [options] name\n", argv[0]);
+    exit(1);
+  }
+  struct metrics_shm *shm = metrics_attach(argv[optind]);
+  if (!shm){
+    error("ERROR opening relay metrics");
+  }
+  /* struct metrics is big (because of the histogram), so keep it off the stack */
+  struct metrics *m = (struct metrics*)malloc(sizeof(struct metrics));
+  struct metrics *prev = (struct metrics*)malloc(sizeof(struct metrics));
+  if (!m || !prev) error("ERROR: malloc() failed in main()\n");
+  struct session_slot *copies = 0;
+  if (sessions){
+    copies = (struct session_slot*)malloc((size_t)shm->workers * shm->session_slots * sizeof(struct session_slot));
+    if (!copies) error("ERROR: malloc() failed in main()\n");
+  }
+  metrics_sum(shm, prev);
+  long long then = shm->start_time;
+  int reports = 0;
+  if (interval){
+    /* the first report covers the first interval, rather than the relay's lifetime */
+    then = now64();
+    sleep(interval);
+  }else{
+    memset(prev, 0, sizeof(struct metrics));
+  }
+  while (1){
+    long long now = now64();
+    metrics_sum(shm, m);
+    print_metrics(shm, m, prev, (now - then) / 1e6);
+    if (sessions) print_sessions(shm, copies);
+    if (!interval || ++reports == count) break;
+    memcpy(prev, m, sizeof(struct metrics));
+    then = now;
+    sleep(interval);
+  }
+  return 0;
+}
+
+/* value below which a fraction p of the recorded times fall (to within a bucket) */
+unsigned long long percentile(struct metrics *m, double p){
+  unsigned long long total = 0, seen = 0;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++){
+    total += m->queued_us[i];
+  }
+  if (!total) return 0;
+  for (i = 0; i < HIST_BUCKETS; i++){
+    seen += m->queued_us[i];
+    if (seen >= p * total) return hist_value(i);
+  }
+  return hist_value(HIST_BUCKETS - 1);
+}
+
+/* totals since the relay started, and rates since 'prev' was taken secs ago */
+void print_metrics(struct metrics_shm *shm, struct metrics *m, struct metrics *prev, double secs){
+  if (secs <= 0) secs = 1e-6;
+  printf("workers:%d uptime:%.0fs sessions:%llu live:%llu\n", shm->workers,
+         (now64() - shm->start_time) / 1e6, m->sessions_started,
+         m->sessions_started - m->sessions_closed);
+  printf("  in:  %llu msgs %llu bytes (%.0f msgs/s %.0f bytes/s)\n", m->msgs_in, m->bytes_in,
+         (m->msgs_in - prev->msgs_in) / secs, (m->bytes_in - prev->bytes_in) / secs);
+  printf("  out: %llu msgs %llu bytes (%.0f msgs/s %.0f bytes/s)\n", m->msgs_out, m->bytes_out,
+         (m->msgs_out - prev->msgs_out) / secs, (m->bytes_out - prev->bytes_out) / secs);
+  printf("  dropped:%llu corrupted:%llu reordered:%llu duplicated:%llu rejected:%llu queued now:%lld\n",
+         m->dropped, m->corrupted, m->reordered, m->duplicated, m->rejected, m->queued);
+  /* latency percentiles over the interval, not the whole run */
+  int i;
+  for (i = 0; i < HIST_BUCKETS; i++){
+    prev->queued_us[i] = m->queued_us[i] - prev->queued_us[i];
+  }
+  printf("  time in relay us: p50:%llu p90:%llu p99:%llu p99.9:%llu max:%llu\n",
+         percentile(prev, 0.5), percentile(prev, 0.9), percentile(prev, 0.99),
+         percentile(prev, 0.999), percentile(prev, 1.0));
+  fflush(stdout);
+}
+
+/* order sessions by id, which is the order they started in */
+int compare_sessions(const void *a, const void *b){
+  return ((const struct session_slot*)a)->id - ((const struct session_slot*)b)->id;
+}
+
+/* the live sessions in the table, with their counters so far */
+void print_sessions(struct metrics_shm *shm, struct session_slot *copies){
+  struct session_slot *slots = metrics_sessions(shm);
+  int i, n = 0;
+  for (i = 0; i < shm->workers * shm->session_slots; i++){
+    if (session_slot_read(&slots[i], &copies[n])) n++;
+  }
+  qsort(copies, n, sizeof(struct session_slot), compare_sessions);
+  long long now = now64();
+  for (i = 0; i < n; i++){
+    struct session_slot *s = &copies[i];
+    struct session_dir *d0 = &s->dir[0], *d1 = &s->dir[1];
+    printf("  session %d worker:%d age:%.0fs msgs:%llu/%llu bytes:%llu/%llu dropped:%llu/%llu "
+           "corrupted:%llu/%llu reordered:%llu/%llu duplicated:%llu/%llu rejected:%llu/%llu\n",
+           s->id, s->worker, (now - s->start_time) / 1e6, d0->msgs_in, d1->msgs_in,
+           d0->bytes_in, d1->bytes_in, d0->dropped, d1->dropped, d0->corrupted, d1->corrupted,
+           d0->reordered, d1->reordered, d0->duplicated, d1->duplicated, d0->rejected, d1->rejected);
+  }
+  fflush(stdout);
+}
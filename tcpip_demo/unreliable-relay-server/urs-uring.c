@@ -0,0 +1,192 @@
+/* Minimal io_uring support for relay-server.c, using the raw system calls */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include "urs-uring.h"
+
+#ifdef URS_HAVE_URING
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz){
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* set up a ring with room for at least 'entries' submissions */
+int uring_init(struct uring *u, unsigned entries){
+  struct io_uring_params p;
+  bzero(u, sizeof(struct uring));
+  bzero(&p, sizeof(p));
+  u->fd = sys_io_uring_setup(entries, &p);
+  if (u->fd < 0) return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)){
+    /* too old for the way we use it */
+    close(u->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  /* the submission and completion rings share one mapping */
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  u->rings = mmap(0, u->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  u->fd, IORING_OFF_SQ_RING);
+  if (u->rings == MAP_FAILED){
+    close(u->fd);
+    return -1;
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe*)mmap(0, u->sqes_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED){
+    munmap(u->rings, u->rings_size);
+    close(u->fd);
+    return -1;
+  }
+  char *r = (char*)u->rings;
+  u->sq_head = (unsigned*)(r + p.sq_off.head);
+  u->sq_tail = (unsigned*)(r + p.sq_off.tail);
+  u->sq_mask = *(unsigned*)(r + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_array = (unsigned*)(r + p.sq_off.array);
+  u->sq_local_tail = *u->sq_tail;
+  u->cq_head = (unsigned*)(r + p.cq_off.head);
+  u->cq_tail = (unsigned*)(r + p.cq_off.tail);
+  u->cq_mask = *(unsigned*)(r + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(r + p.cq_off.cqes);
+  return 0;
+}
+
+void uring_exit(struct uring *u){
+  if (u->br){
+    munmap(u->br, u->buf_count * sizeof(struct io_uring_buf));
+    free(u->bufs);
+  }
+  munmap(u->sqes, u->sqes_size);
+  munmap(u->rings, u->rings_size);
+  close(u->fd);
+}
+
+/* register 'count' buffers of 'size' bytes as provided buffer group 'group' */
+int uring_setup_buffers(struct uring *u, int group, int count, int size){
+  struct io_uring_buf_reg reg;
+  size_t ring_size = count * sizeof(struct io_uring_buf);
+  void *ring = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) return -1;
+  bzero(&reg, sizeof(reg));
+  reg.ring_addr = (unsigned long)ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+    munmap(ring, ring_size);
+    return -1;
+  }
+  u->br = (struct io_uring_buf_ring*)ring;
+  u->buf_count = count;
+  u->bufs = (char*)malloc((size_t)count * size);
+  if (!u->bufs){
+    errno = ENOMEM;
+    return -1;
+  }
+  u->buf_size = size;
+  u->buf_group = group;
+  u->br_tail = 0;
+  int bid;
+  for (bid = 0; bid < count; bid++){
+    uring_recycle_buffer(u, bid);
+  }
+  return 0;
+}
+
+/* address of a provided buffer */
+char *uring_buffer(struct uring *u, int bid){
+  return u->bufs + (size_t)bid * u->buf_size;
+}
+
+/* hand a provided buffer back to the kernel for another recv */
+void uring_recycle_buffer(struct uring *u, int bid){
+  struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->buf_count - 1)];
+  b->addr = (unsigned long)uring_buffer(u, bid);
+  b->len = u->buf_size;
+  b->bid = bid;
+  u->br_tail++;
+  __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/* publish queued submissions to the kernel, returning how many it has yet to consume */
+static unsigned uring_flush_sq(struct uring *u){
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+  return u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* make sure the next 'n' submission queue entries fit without an intervening
+   submit (linked requests must reach the kernel together) */
+void uring_reserve(struct uring *u, unsigned n){
+  while (u->sq_entries - (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) < n){
+    unsigned pending = uring_flush_sq(u);
+    if (sys_io_uring_enter(u->fd, pending, 0, 0, 0, 0) < 0 && errno != EINTR && errno != EBUSY){
+      perror("ERROR on io_uring_enter()");
+      exit(1);
+    }
+  }
+}
+
+/* get a zeroed submission queue entry, submitting queued ones first if full */
+struct io_uring_sqe *uring_get_sqe(struct uring *u){
+  uring_reserve(u, 1);
+  unsigned idx = u->sq_local_tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  bzero(sqe, sizeof(struct io_uring_sqe));
+  u->sq_array[idx] = idx;
+  u->sq_local_tail++;
+  return sqe;
+}
+
+/* submit queued entries and wait until at least one completion is available
+   or timeout_ms has passed (-1: no timeout) */
+int uring_submit_and_wait(struct uring *u, int timeout_ms){
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned pending = uring_flush_sq(u);
+  bzero(&arg, sizeof(arg));
+  if (timeout_ms >= 0){
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    arg.ts = (unsigned long)&ts;
+  }
+  int ret = sys_io_uring_enter(u->fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                               &arg, sizeof(arg));
+  if (ret < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)){
+    /* timed out, interrupted, or completions need reaping first: not an error */
+    return 0;
+  }
+  return ret;
+}
+
+/* next available completion, or 0 */
+struct io_uring_cqe *uring_peek_cqe(struct uring *u){
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+  return &u->cqes[head & u->cq_mask];
+}
+
+/* release the completion returned by uring_peek_cqe() */
+void uring_cqe_seen(struct uring *u){
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,67 @@
+/* Minimal io_uring support for relay-server.c, using the raw system calls
+   (liburing is not required). URS_HAVE_URING is defined when the kernel
+   headers are new enough for everything the relay uses: multishot accept,
+   multishot recv and provided buffer rings. */
+
+#if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_ENTER_EXT_ARG)
+#      define URS_HAVE_URING 1
+#    endif
+#  endif
+#endif
+
+#ifdef URS_HAVE_URING
+
+/* a submission/completion queue pair, plus one provided buffer ring */
+struct uring{
+  int fd;
+  /* submission queue */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;     // tail including SQEs not yet published to the kernel
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  /* completion queue */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  /* mappings, for cleanup */
+  void *rings;
+  size_t rings_size;
+  size_t sqes_size;
+  /* provided buffer ring */
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  int buf_count;              // number of buffers (a power of two)
+  int buf_size;               // size of each buffer
+  int buf_group;              // buffer group id given to recv requests
+  unsigned short br_tail;
+};
+
+/* set up a ring with room for at least 'entries' submissions; returns -1 (with
+   errno set) if io_uring is unavailable */
+int uring_init(struct uring *u, unsigned entries);
+void uring_exit(struct uring *u);
+/* register 'count' buffers of 'size' bytes as provided buffer group 'group';
+   returns -1 (with errno set) if the kernel doesn't support buffer rings */
+int uring_setup_buffers(struct uring *u, int group, int count, int size);
+/* address of a provided buffer, and handing it back to the kernel once used */
+char *uring_buffer(struct uring *u, int bid);
+void uring_recycle_buffer(struct uring *u, int bid);
+/* make room for 'n' submissions that must reach the kernel together (a link chain) */
+void uring_reserve(struct uring *u, unsigned n);
+/* get a zeroed submission queue entry, submitting queued ones first if full */
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+/* submit queued entries and wait until at least one completion is available
+   or timeout_ms has passed (-1: no timeout) */
+int uring_submit_and_wait(struct uring *u, int timeout_ms);
+/* next available completion, or 0; uring_cqe_seen() releases it */
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+#endif
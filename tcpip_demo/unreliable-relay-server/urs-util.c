@@ -7,44 +7,301 @@
 #include <sys/time.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
 #include "urs-util.h"
 
 //#define DEBUG
 
-/* Print out contents of a buffer (plus the byte *after* the buffer),
+/* leveled logging, buffered per thread */
+int log_level = LOG_INFO;
+static __thread char log_buf[LOG_BUFSIZE];
+static __thread int log_len;
+
+/* write all of data to stderr, bypassing stdio */
+static void log_write(const char *data, int len){
+  while (len > 0){
+    int n = write(2, data, len);
+    if (n < 0){
+      if (errno == EINTR) continue;
+      return; // nowhere left to report it
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/* append to the log buffer, flushing first if there isn't room */
+static void log_append(const char *data, int len){
+  if (log_len + len > LOG_BUFSIZE){
+    log_flush();
+    if (len > LOG_BUFSIZE){
+      log_write(data, len);
+      return;
+    }
+  }
+  memcpy(log_buf + log_len, data, len);
+  log_len += len;
+}
+
+void log_printf(const char *fmt, ...){
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(log_buf + log_len, LOG_BUFSIZE - log_len, fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  if (log_len + n < LOG_BUFSIZE){
+    /* the usual case: it fitted (vsnprintf() needs room for a '\0' too) */
+    log_len += n;
+    return;
+  }
+  /* too long for the space left: format it again, somewhere big enough */
+  char *big = (char*)malloc(n + 1);
+  if (!big) return;
+  va_start(ap, fmt);
+  vsnprintf(big, n + 1, fmt, ap);
+  va_end(ap);
+  log_append(big, n);
+  free(big);
+}
+
+void log_perror(const char *msg){
+  log_printf("%s: %s\n", msg, strerror(errno));
+}
+
+/* write out everything logged by this thread so far */
+void log_flush(){
+  log_write(log_buf, log_len);
+  log_len = 0;
+}
+
+/* Log the contents of a buffer (plus the byte *after* the buffer),
    translating chars such as '\n' and '\0' to a more readable form. 
    Useful in debugging buffer manipulation code. */
 void dumpbuf(char* buf, int size){
-  int i = 0;
-  fprintf(stderr,"dumpbuf():%d:",size);
+  char out[4096];
+  int i = 0, n = 0;
+  log_printf("dumpbuf():%d:", size);
   for(i = 0; i < size+1; i++){
-    if (i == size) fputc(':',stderr); // mark end of buffer
+    if (n > (int)sizeof(out) - 3){ // room for up to two bytes, plus the final newline
+      log_append(out, n);
+      n = 0;
+    }
+    if (i == size) out[n++] = ':'; // mark end of buffer
     switch(buf[i]){
       case '\n':
-        fputc('N',stderr);
+        out[n++] = 'N';
         break;
       case '\0':
-        fputc('0',stderr);
+        out[n++] = '0';
         break;
       case '\t':
-        fputc('T',stderr);
+        out[n++] = 'T';
         break;
       case '\r':
-        fputc('R',stderr);
+        out[n++] = 'R';
         break;
       default:
-        fputc(buf[i],stderr);
+        out[n++] = buf[i];
     }
   }
-  fputc('\n',stderr);
+  out[n++] = '\n';
+  log_append(out, n);
 }
 
-/* Report a system call error condition and exit. */
+/* Report a system call error condition (after flushing the log) and exit. */
 void error(const char *msg){
+  log_flush();
   perror(msg);
   exit(1);
 }
 
+/* splitmix64: expands a seed into well-mixed state words */
+static unsigned long long splitmix64(unsigned long long *x){
+  unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* start stream number 'stream' of the generator seeded with 'seed' */
+void rng_seed(struct rng *r, unsigned long long seed, unsigned long long stream){
+  unsigned long long x = stream;
+  x = seed ^ splitmix64(&x);
+  int i;
+  for(i = 0; i < 4; i++){
+    r->s[i] = splitmix64(&x);
+  }
+  r->next = RNG_BATCH;
+}
+
+static inline unsigned long long rotl(unsigned long long x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+/* generate the next RNG_BATCH numbers (two per step of xoshiro256**) */
+void rng_refill(struct rng *r){
+  unsigned long long s0 = r->s[0], s1 = r->s[1], s2 = r->s[2], s3 = r->s[3];
+  int i;
+  for(i = 0; i < RNG_BATCH; i += 2){
+    unsigned long long out = rotl(s1 * 5, 7) * 9;
+    unsigned long long t = s1 << 17;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = rotl(s3, 45);
+    r->buf[i] = (unsigned int)(out >> 32);
+    r->buf[i+1] = (unsigned int)out;
+  }
+  r->s[0] = s0; r->s[1] = s1; r->s[2] = s2; r->s[3] = s3;
+  r->next = 0;
+}
+
+/* pooled allocators for message buffers and queue nodes */
+/* every buffer is preceded by a header recording its size class (or
+   POOL_CLASSES for a buffer that was too big for any class); a free buffer's
+   header space holds the free list link instead */
+union msg_hdr{
+  int cls;
+  union msg_hdr *next;
+  long long align;
+};
+/* free lists and counters, private to each thread so no locking is needed */
+static __thread union msg_hdr *msg_free_list[POOL_CLASSES];
+static __thread struct mqn *node_free_list;
+static __thread struct pool_stats pool_stats;
+
+/* size class for a buffer of the given size, or POOL_CLASSES if too big */
+static int msg_class(size_t size){
+  if (size <= (1 << POOL_MIN_SHIFT)) return 0;
+  int cls = (64 - __builtin_clzll(size - 1)) - POOL_MIN_SHIFT;
+  return cls < POOL_CLASSES ? cls : POOL_CLASSES;
+}
+
+/* allocate a buffer of at least size bytes */
+void *msg_alloc(size_t size){
+  int cls = msg_class(size);
+  union msg_hdr *h;
+  if (cls == POOL_CLASSES){
+    pool_stats.big.allocs++;
+    h = (union msg_hdr*)malloc(sizeof(union msg_hdr) + size);
+  }else{
+    struct pool_counters *pc = &pool_stats.msgs[cls];
+    pc->allocs++;
+    h = msg_free_list[cls];
+    if (h){
+      msg_free_list[cls] = h->next;
+      pc->hits++;
+      pc->cached--;
+    }else{
+      h = (union msg_hdr*)malloc(sizeof(union msg_hdr) + ((size_t)1 << (cls + POOL_MIN_SHIFT)));
+    }
+  }
+  if (!h) error("ERROR: malloc() failed in msg_alloc()\n");
+  h->cls = cls;
+  return h + 1;
+}
+
+/* release a buffer obtained from msg_alloc() */
+void msg_free(void *msg){
+  if (!msg) return;
+  union msg_hdr *h = (union msg_hdr*)msg - 1;
+  int cls = h->cls;
+  if (cls == POOL_CLASSES){
+    pool_stats.big.frees++;
+    free(h);
+    return;
+  }
+  struct pool_counters *pc = &pool_stats.msgs[cls];
+  pc->frees++;
+  if ((pc->cached + 1) << (cls + POOL_MIN_SHIFT) > POOL_MAX_CACHED){
+    /* don't hoard memory after a burst */
+    free(h);
+    return;
+  }
+  h->next = msg_free_list[cls];
+  msg_free_list[cls] = h;
+  pc->cached++;
+}
+
+/* allocate a queue node, refilling the free list a slab at a time */
+static struct mqn *node_alloc(){
+  pool_stats.nodes.allocs++;
+  if (node_free_list){
+    pool_stats.nodes.hits++;
+  }else{
+    struct mqn *slab = (struct mqn*)malloc(NODE_SLAB * sizeof(struct mqn));
+    if (!slab) error("ERROR: malloc() failed in node_alloc()\n");
+    int i;
+    for (i = 0; i < NODE_SLAB; i++){
+      slab[i].next = node_free_list;
+      node_free_list = &slab[i];
+    }
+    pool_stats.nodes.cached += NODE_SLAB;
+  }
+  struct mqn *m = node_free_list;
+  node_free_list = m->next;
+  pool_stats.nodes.cached--;
+  return m;
+}
+
+/* return a queue node to the free list */
+static void node_free(struct mqn *m){
+  pool_stats.nodes.frees++;
+  m->next = node_free_list;
+  node_free_list = m;
+  pool_stats.nodes.cached++;
+}
+
+/* copy out the calling thread's pool counters */
+void get_pool_stats(struct pool_stats *s){
+  *s = pool_stats;
+}
+
+/* log the calling thread's pool counters and hit rates */
+void dump_pool_stats(){
+  int i;
+  struct pool_counters *pc = &pool_stats.nodes;
+  log_printf("  pool nodes: allocs:%llu hits:%llu (%.1f%%) cached:%llu\n", pc->allocs, pc->hits,
+          pc->allocs ? 100.0 * pc->hits / pc->allocs : 0.0, pc->cached);
+  for (i = 0; i < POOL_CLASSES; i++){
+    pc = &pool_stats.msgs[i];
+    if (!pc->allocs) continue;
+    log_printf("  pool msg%d: allocs:%llu hits:%llu (%.1f%%) cached:%llu\n",
+            1 << (i + POOL_MIN_SHIFT), pc->allocs, pc->hits, 100.0 * pc->hits / pc->allocs, pc->cached);
+  }
+  if (pool_stats.big.allocs)
+    log_printf("  pool big: allocs:%llu\n", pool_stats.big.allocs);
+}
+
+/* create an input chunk holding one reference. size is the whole allocation,
+   so a power-of-two size fills a pool size class exactly; the chunk has room
+   for size - CHUNK_OVERHEAD bytes of data. */
+struct chunk *chunk_new(int size){
+  assert(size > CHUNK_OVERHEAD);
+  struct chunk *c = (struct chunk*)msg_alloc(size);
+  c->refs = 1;
+  size -= CHUNK_OVERHEAD;
+  c->size = size;
+  c->data[size] = '\0';
+  return c;
+}
+
+/* drop a reference to a chunk, freeing it with the last one */
+void chunk_unref(struct chunk *c){
+  assert(c->refs > 0);
+  if (!--c->refs) msg_free(c);
+}
+
+/* drop a message's reference to its chunk */
+void msg_release(struct msg *m){
+  if (m->chunk) chunk_unref(m->chunk);
+  bzero(m, sizeof(struct msg));
+}
+
 /* interface functions for send queue */
 /* create a new message queue */
 struct mq *make_queue(){
@@ -54,104 +311,148 @@ struct mq *make_queue(){
   return q;
 }
 
-/* insert message into queue sorted by time_gate */
-void enqueue(struct mq *q, char *msg, int delay_ms){
-  struct mqn *m = (struct mqn*)malloc(sizeof(struct mqn));
-  if (!m) error("ERROR: malloc() failed in function enqueue()\n");
+/* free a message queue along with any messages still in it */
+void free_queue(struct mq *q){
+  struct mqn *m = q->head;
+  while (m){
+    struct mqn *next = m->next;
+    msg_release(&m->msg);
+    node_free(m);
+    m = next;
+  }
+  free(q->heap);
+  free(q);
+}
+
+/* heap ordering: earliest time_gate first, then earliest arrival */
+static int mqn_before(struct mqn *a, struct mqn *b){
+  if (a->time_gate != b->time_gate) return a->time_gate < b->time_gate;
+  return a->seq < b->seq;
+}
+
+/* place node m at heap slot i */
+static void heap_set(struct mq *q, int i, struct mqn *m){
+  q->heap[i] = m;
+  m->slot = i;
+}
+
+/* move the node at slot i up towards the root until its parent is earlier.
+   A node appended with a time_gate no earlier than its parent stops immediately,
+   which is the common case because most messages get the same latency. */
+static void heap_sift_up(struct mq *q, int i){
+  struct mqn *m = q->heap[i];
+  while (i > 0){
+    int parent = (i - 1) / 4;
+    if (!mqn_before(m, q->heap[parent])) break;
+    heap_set(q, i, q->heap[parent]);
+    i = parent;
+  }
+  heap_set(q, i, m);
+}
+
+/* move the node at slot i down until none of its (up to four) children is earlier */
+static void heap_sift_down(struct mq *q, int i){
+  struct mqn *m = q->heap[i];
+  while (1){
+    int first = 4 * i + 1;
+    int last = first + 4 < q->count ? first + 4 : q->count;
+    int best = -1;
+    int child;
+    for (child = first; child < last; child++){
+      if (best < 0 || mqn_before(q->heap[child], q->heap[best])) best = child;
+    }
+    if (best < 0 || !mqn_before(q->heap[best], m)) break;
+    heap_set(q, i, q->heap[best]);
+    i = best;
+  }
+  heap_set(q, i, m);
+}
+
+/* insert message into queue, to be sent no earlier than delay_ms from now.
+   The queue takes over the message's chunk reference. */
+void enqueue(struct mq *q, struct msg *msg, int delay_ms){
+  struct mqn *m = node_alloc();
   bzero(m, sizeof(struct mqn));
-  m->msg = msg;
-  m->next = 0;
+  m->msg = *msg;
+  m->seq = q->seq++;
   /* calculate time_gate in microseconds as current time plus delay milliseconds */
-  m->time_gate = now64() + delay_ms*1000;
+  m->msg.queued_at = now64();
+  m->time_gate = m->msg.queued_at + delay_ms*1000;
+
+  /* add to heap, growing it if necessary */
+  if (q->count == q->size){
+    int size = q->size ? q->size * 2 : 64;
+    struct mqn **heap = (struct mqn**)realloc(q->heap, size * sizeof(struct mqn*));
+    if (!heap) error("ERROR: realloc() failed in function enqueue()\n");
+    q->heap = heap;
+    q->size = size;
+  }
+  heap_set(q, q->count++, m);
+  heap_sift_up(q, m->slot);
 
-  if (!q->tail){
-    /* insert into empty queue */
+  /* append to arrival list */
+  m->prev = q->tail;
+  m->next = 0;
+  if (q->tail){
+    q->tail->next = m;
+  }else{
     assert(!q->head);
     q->head = m;
-    q->tail = m;
-  }else{
-    assert(q->tail);
-    assert(q->head);
-    /* insert into queue sorted by time_gate value (smallest first) */
-    if (m->time_gate >= q->tail->time_gate){
-      /* append after tail of queue - should be the common case */
-      q->tail->next = m;
-      m->prev = q->tail;
-      q->tail = m;
-    }else if (m->time_gate < q->head->time_gate){
-      /* insert before head of queue */
-      m->next = q->head;
-      q->head->prev = m;
-      q->head = m;
-    }else{
-      /* walk the list to find insert point */
-      /* TODO: could start at tail, now that list is doubly-linked ... ?? */
-      struct mqn *insert, *previous;
-      assert(q->head != q->tail); // at least 2 items in queue
-      insert = q->head;
-      while (insert->time_gate <= m->time_gate){
-        previous = insert;
-        insert = insert->next;
-      }
-      /* insert here, between 'previous' and 'insert' */
-      assert(insert && previous);
-      m->next = insert;
-      insert->prev = m;
-      previous->next = m;
-      m->prev = previous;
-    }
   }
+  q->tail = m;
   #ifdef DEBUG
     dump_queue(q);
   #endif
 }
 
-/* Retrieve and remove the message at the head of the queue - but only if it's
-   time_gate is less than the current system time. Queue is sorted by time_gate,
-   so if the head item is not ready to go yet, we don't have to bother checking
-   any others :-). */
-char *dequeue(struct mq *q){
-  if (!q->head){
+/* Retrieve and remove the earliest message in the queue - but only if it's
+   time_gate is less than the current system time. The heap keeps the earliest
+   message at its root, so if that one is not ready to go yet, we don't have to
+   bother checking any others :-). Returns 1 and hands the message (and its chunk
+   reference) over in *msg, or 0 if nothing is due. */
+int dequeue(struct mq *q, struct msg *msg){
+  if (!q->count){
     /* queue is empty */
-    assert(!q->tail);
+    assert(!q->head && !q->tail);
     return 0;
-  }else{
-    /* queue is non-empty */
-    assert(q->tail);
-    long long now = now64();
-    #ifdef DEBUG
-      fprintf(stderr, "DEBUG dequeue(): now64():%lld time_gate:%lld remain:%lld\n",
-              now, q->head->time_gate, q->head->time_gate - now);
-    #endif
-    if (now < q->head->time_gate){
-      /* it's still too early to send this message */
-      return 0;
-    }
-    /* the head message is ready to send, so let's remove it from the queue */
-    struct mqn *m = q->head;
-    q->head = q->head->next;
-    if (q->head){
-      q->head->prev = 0;
-    }else{
-      /* we just removed last item, so queue is now empty */
-      q->tail = 0;
-    }
-    char *msg = m->msg;
-    free(m);
-    #ifdef DEBUG
-      dump_queue(q);
-    #endif
-    return msg;
   }
+  long long now = now64();
+  struct mqn *m = q->heap[0];
+  #ifdef DEBUG
+    fprintf(stderr, "DEBUG dequeue(): now64():%lld time_gate:%lld remain:%lld\n",
+            now, m->time_gate, m->time_gate - now);
+  #endif
+  if (now < m->time_gate){
+    /* it's still too early to send this message */
+    return 0;
+  }
+  /* the earliest message is ready to send, so let's remove it from the heap ... */
+  q->count--;
+  if (q->count){
+    heap_set(q, 0, q->heap[q->count]);
+    heap_sift_down(q, 0);
+  }
+  /* ... and from the arrival list */
+  if (m->prev) m->prev->next = m->next; else q->head = m->next;
+  if (m->next) m->next->prev = m->prev; else q->tail = m->prev;
+  *msg = m->msg;
+  node_free(m);
+  #ifdef DEBUG
+    dump_queue(q);
+  #endif
+  return 1;
 }
 
 /* reorder a message near the tail end of the queue.
-   If the queue contains enough items to do so, a POSITIVE step will move the tail item
-   forward step places in the queue, and a NEGATIVE step will move the stepth-from-last
-   item to the tail of the queue.  A ZERO step does nothing at all.
-   When a message is moved, it's time_gate value will be changed to suit its new location
-   by setting it equal to the time_gate of the item it is being placed before/behind.
-   If there are not enough items in the queue to make the requested move, then .... ???
+   If the queue contains enough items to do so, a POSITIVE step will move the newest
+   message forward step places in the queue, and a NEGATIVE step will move the
+   stepth-from-newest message to the tail of the queue.  A ZERO step does nothing
+   (callers wanting a random step choose it themselves).  If there are fewer items
+   than |step|, the move stops at the head of the queue.
+   Places are counted in arrival order, and a move is made by rotating the messages
+   between the nodes it passes over: each node keeps its time_gate (and its place in
+   the heap), so the moved message simply inherits the time_gate of the slot it lands
+   in, and no heap maintenance is needed.
    Reordering will obviously only work meaningfully if there are enough items in the
    queue.  The easy way to ensure this is to set a suitable latency value (with -l) so
    that messages spend enough time in the queue to potentially be reordered.
@@ -160,129 +461,63 @@ char *dequeue(struct mq *q){
    we might reorder a small number of messages many times each, but reordering a larger
    number of messages a small (one?) number of times each sounds more like what we want. */
 void reorder(struct mq *q, int step){
-  #ifdef DEBUG
-    fprintf(stderr, "DEBUG: reorder(): 1.0\n");
-  #endif
-  if (q->head == q->tail){
-    /* queue is either empty or has only one item, so can't reorder anything */
+  if (q->count < 2 || !step){
+    /* queue is either empty or has only one item, so can't reorder anything;
+       or there is no move to make */
     return;
   }
-  while (!step){
-    /* step is zero, so randomise it in the range -5..+5 */
-    step = rand()%11 - 5;
-  }
-  
+
   /* find the item which is |step| items back from the tail of the list */
   int steps = step<0?0-step:step;
   struct mqn *p = q->tail;
-  while (p && p->prev && steps){
+  while (p->prev && steps){
     p = p->prev;
     steps--;
   }
-  #ifdef DEBUG
-    fprintf(stderr, "DEBUG: reorder(): 2.0\n");
-  #endif
   /* now p is |step| positions back from the tail of the list, or is at the
      head of the list if the list did not contain enough items */
+  struct mqn *n;
+  struct msg moved;
   if (step < 0){
-    #ifdef DEBUG
-      fprintf(stderr, "DEBUG: reorder(): 2.1\n");
-    #endif
-    /* move the item at p down to the tail of the queue */
-    if (p == q->head){
-      #ifdef DEBUG
-        fprintf(stderr, "DEBUG: reorder(): 2.1.1\n");
-      #endif
-      /* disconnect head node */
-      assert(q->head);
-      q->head = q->head->next;
-      q->head->prev = 0;
-      #ifdef DEBUG
-        fprintf(stderr, "DEBUG: reorder(): 2.1.2\n");
-      #endif
-    }else{
-      #ifdef DEBUG
-        fprintf(stderr, "DEBUG: reorder(): 2.1.3a\n");
-      #endif
-      /* disconnect non-head node */
-      assert(p);
-      assert(p->prev);
-      assert(p->next);
-      p->prev->next = p->next;
-      #ifdef DEBUG
-        fprintf(stderr, "DEBUG: reorder(): 2.1.3b\n");
-      #endif
-      p->next->prev = p->prev;
-      #ifdef DEBUG
-        fprintf(stderr, "DEBUG: reorder(): 2.1.4\n");
-      #endif
+    /* move the message at p down to the tail of the queue, shifting the
+       messages after it one place forward */
+    moved = p->msg;
+    for (n = p; n != q->tail; n = n->next){
+      n->msg = n->next->msg;
     }
-    /* reconnect this node at tail of queue */
-    q->tail->next = p;
-    p->prev = q->tail;
-    p->next = 0;
-    q->tail = p;
-    #ifdef DEBUG
-      fprintf(stderr, "DEBUG: reorder(): 2.1.5\n");
-    #endif
-    /* update time_gate for moved node to keep queue time-sorted */
-    q->tail->time_gate = q->tail->prev->time_gate;
-    #ifdef DEBUG
-      fprintf(stderr, "DEBUG: reorder(): 2.2\n");
-    #endif
-
+    q->tail->msg = moved;
   }else{
-    #ifdef DEBUG
-      fprintf(stderr, "DEBUG: reorder(): 2.3\n");
-    #endif
-    assert(step > 0);
-    /* move the tail of the queue up in front of the item at p */
-    /* disconnect from tail */
-    struct mqn *t = q->tail;
-    q->tail = q->tail->prev;
-    q->tail->next = 0;
-    if (p == q->head){
-      /* insert before p as new head of queue */
-      t->next = p;
-      t->prev = 0;
-      p->prev = t;
-      q->head = t;
-    }else{
-      /* insert before p as non-head node */
-      t->next = p;
-      t->prev = p->prev;
-      p->prev->next = t;
-      p->prev = t;
+    /* move the message at the tail of the queue up into p's place, shifting
+       p and the messages after it one place back */
+    moved = q->tail->msg;
+    for (n = q->tail; n != p; n = n->prev){
+      n->msg = n->prev->msg;
     }
-    #ifdef DEBUG
-      fprintf(stderr, "DEBUG: reorder(): 2.4\n");
-    #endif
+    p->msg = moved;
   }
-
 }
 
-/* print queue contents to stderr for debugging */
+/* log queue contents (in arrival order) for debugging */
 void dump_queue(struct mq *q){
-  fprintf(stderr, "  --- dump_queue():\n");
+  log_printf("  --- dump_queue():\n");
   struct mqn *n = q->head;
   long long now = now64();
   while(n){
-    fprintf(stderr, "  time_gate:%lld remain:%lld ", n->time_gate, now - n->time_gate); 
-    dumpbuf(n->msg, strlen(n->msg));
+    log_printf("  time_gate:%lld remain:%lld ", n->time_gate, now - n->time_gate); 
+    dumpbuf(n->msg.data, n->msg.len);
     n = n->next;
   }
-  fprintf(stderr, "  --- end of dump_queue() ---------\n");
+  log_printf("  --- end of dump_queue() ---------\n");
 }
 
 /* get time in microseconds when next message is due to be send from a queue */
 long long get_next_send_time_micro(struct mq *q){
-  if (!q->head){
+  if (!q->count){
     /* queue is empty, so send_time is approximately "never" */
     return LLONG_MAX;
   }else{
-    /* head of queue will have earliest time_gate */
-    assert(q->head);
-    return q->head->time_gate;
+    /* root of heap will have earliest time_gate */
+    return q->heap[0]->time_gate;
   }
 }
 
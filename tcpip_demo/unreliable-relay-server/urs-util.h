@@ -1,6 +1,23 @@
 /* Set of utility functions for (unreliable) relay-server.c and client.c */
 
-/* Print out contents of a buffer (plus the byte *after* the buffer),
+/* Leveled logging. Messages are formatted into a per-thread buffer which
+   log_flush() writes out to stderr in one write() - the relay does that at the
+   end of each batch of events, before waiting for more - rather than going
+   through unbuffered stdio a line (or a byte) at a time. LOG() tests the level
+   before its arguments are evaluated, so disabled messages cost one compare. */
+#define LOG_INFO 0     // sessions starting and ending, errors
+#define LOG_MSG 1      // every message and read (-v)
+#define LOG_DUMP 2     // input buffer contents (-vv)
+#define LOG_DEBUG 3    // queue contents and timeouts (-vvv)
+#define LOG_BUFSIZE 65536
+extern int log_level;
+#define LOG(level, ...) do{ if ((level) <= log_level) log_printf(__VA_ARGS__); }while(0)
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/* perror(), through the log */
+void log_perror(const char *msg);
+void log_flush();
+
+/* Log the contents of a buffer (plus the byte *after* the buffer),
    translating chars such as '\n' and '\0' to a more readable form. 
    Useful in debugging buffer manipulation code. */
 void dumpbuf(char* buf, int size);
@@ -8,27 +25,107 @@ void dumpbuf(char* buf, int size);
 /* get current system time in microseconds since epoch as a 64-bit number */
 long long now64();
 
-/* Report a system call error condition and exit. */
+/* Report a system call error condition (after flushing the log) and exit. */
 void error(const char *msg);
 
-/* data structures and interface for send queue (we need two of these) */
+/* Pseudo-random number streams (xoshiro256**), one per user, so that nothing is
+   shared between threads and a given seed and stream number always produce the
+   same sequence. Numbers are generated RNG_BATCH at a time and handed out from
+   the buffer, so drawing one is usually just a load and an increment. */
+#define RNG_BATCH 64
+struct rng{
+  unsigned long long s[4];       // generator state
+  unsigned int buf[RNG_BATCH];   // numbers generated but not yet used
+  int next;                      // index of the next unused number in buf
+};
+void rng_seed(struct rng *r, unsigned long long seed, unsigned long long stream);
+void rng_refill(struct rng *r);
+/* 32 random bits */
+static inline unsigned int rng_next(struct rng *r){
+  if (r->next == RNG_BATCH) rng_refill(r);
+  return r->buf[r->next++];
+}
+/* a random number in the range 0..n-1 (n > 0), without a division */
+static inline unsigned int rng_below(struct rng *r, unsigned int n){
+  return (unsigned int)(((unsigned long long)rng_next(r) * n) >> 32);
+}
+
+/* Pooled allocation for message buffers and queue nodes.
+   Freed blocks are kept on per-thread free lists (one per power-of-two size
+   class for buffers) and handed out again instead of going back to malloc(),
+   so steady traffic recycles the same memory. Queue nodes are carved from
+   slabs and never returned to malloc(). Buffers larger than the biggest class
+   are malloc()ed directly. Counters show how often the pools are hit. */
+#define POOL_CLASSES 12       // buffer size classes: 32, 64, ... 65536 bytes
+#define POOL_MIN_SHIFT 5      // log2 of the smallest class
+#define POOL_MAX_CACHED (4 << 20) // most free bytes kept per buffer size class
+#define NODE_SLAB 64          // queue nodes allocated per slab
+struct pool_counters{
+  unsigned long long allocs;  // blocks requested
+  unsigned long long hits;    // requests satisfied from a free list
+  unsigned long long frees;   // blocks released
+  unsigned long long cached;  // blocks currently on the free list
+};
+struct pool_stats{
+  struct pool_counters nodes;               // queue nodes
+  struct pool_counters msgs[POOL_CLASSES];  // buffers, by size class
+  struct pool_counters big;                 // buffers too big for any class
+};
+void *msg_alloc(size_t size);
+void msg_free(void *msg);
+void get_pool_stats(struct pool_stats *s);
+void dump_pool_stats();
+
+/* Reference-counted input chunk. Connections read() straight into a chunk, and
+   each complete line in it is queued as a slice of the chunk instead of being
+   copied out, so a chunk lives on until the last slice of it has been sent. */
+struct chunk{
+  int refs;
+  int size;      // capacity of data[] (one spare byte follows, for dumpbuf())
+  char data[];
+};
+/* bytes of a chunk allocation not available for data */
+#define CHUNK_OVERHEAD ((int)sizeof(struct chunk) + 1)
+/* a message: len bytes at data, inside chunk, holding one reference to chunk */
+struct msg{
+  struct chunk *chunk;
+  char *data;
+  int len;
+  long long queued_at;     // when enqueue() queued it (microseconds)
+};
+struct chunk *chunk_new(int size);
+void chunk_unref(struct chunk *c);
+void msg_release(struct msg *m);
+
+/* data structures and interface for send queue (one per client connection) */
 /* message queue node */
 struct mqn{
-  char *msg;
-  long long time_gate; // don't send before
-  struct mqn *next;
+  struct msg msg;
+  long long time_gate;     // don't send before
+  unsigned long long seq;  // arrival number, breaks time_gate ties first-come-first-served
+  int slot;                // index of this node in the queue's heap
+  struct mqn *next;        // arrival order list, newest at the tail
   struct mqn *prev;
 };
-/* message queue - pointers to a linked list of nodes */
+/* message queue - a 4-ary min-heap of nodes keyed on time_gate, so that inserts
+   are O(1) in the usual case of non-decreasing time_gates (O(log n) at worst) and
+   the next message due is always at heap[0]. The same nodes are also linked in
+   arrival order, which is what reorder() works on. */
 struct mq{
-  struct mqn *head;
-  struct mqn *tail;
+  struct mqn **heap;
+  int count;               // number of nodes in the heap
+  int size;                // allocated heap slots
+  unsigned long long seq;  // arrival counter
+  struct mqn *head;        // oldest arrival
+  struct mqn *tail;        // newest arrival
 };
 /* message queue manipulation functions (interface) */
 struct mq *make_queue();
-void enqueue(struct mq *q, char *msg, int delay_ms);
-char *dequeue(struct mq *q);
+void free_queue(struct mq *q);
+void enqueue(struct mq *q, struct msg *msg, int delay_ms);
+int dequeue(struct mq *q, struct msg *msg);
 void reorder(struct mq *q, int step);
 void dump_queue(struct mq *q);
 
+long long get_next_send_time_micro(struct mq *q);
 int get_poll_timeout_milli(struct mq **queues, int q_count);